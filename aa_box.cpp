@@ -8,4 +8,10 @@ intersect_result aa_box::intersect(const ray &r) const
 std::vector<intersect_result> aa_box::intersect_all(const ray &r) const
 {
     return geometry.intersect_all(r);
+}
+
+std::size_t aa_box::count_intersections(const ray &r, double t_min, double t_max,
+                                        std::size_t max_count) const
+{
+    return geometry.count_intersections(r, t_min, t_max, max_count);
 }
\ No newline at end of file
@@ -22,6 +22,18 @@ public:
 
     intersect_result intersect(const ray &r) const override;
     std::vector<intersect_result> intersect_all(const ray &r) const override;
+    std::size_t count_intersections(const ray &r, double t_min, double t_max,
+                                    std::size_t max_count) const override;
+
+    bool bounded() const override
+    {
+        return true;
+    }
+
+    aa_cube get_aabb() const override
+    {
+        return geometry;
+    }
 };
 
 #endif // _AA_BOX_H_
\ No newline at end of file
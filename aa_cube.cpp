@@ -1,5 +1,6 @@
 #include <cstddef>
 #include <cstdio>
+#include <algorithm>
 
 #include "aa_cube.h"
 
@@ -217,7 +218,80 @@ intersect_result aa_cube::intersect(const ray &r) const
     return ir;
 }
 
+bool aa_cube::clip(const ray &r, double &t_near, double &t_far) const
+{
+    vector3df p2 = p + size;
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        const double o = r.origin.dim[dim], d = r.direction.dim[dim];
+        if (d == 0.0)
+        {
+            // parallel to the slab
+            if (o < p.dim[dim] - eps || o > p2.dim[dim] + eps)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        double d_inv = 1.0 / d;
+        double t0 = (p.dim[dim] - eps - o) * d_inv,
+               t1 = (p2.dim[dim] + eps - o) * d_inv;
+        if (t0 > t1)
+        {
+            std::swap(t0, t1);
+        }
+        if (t0 > t_near)
+        {
+            t_near = t0;
+        }
+        if (t1 < t_far)
+        {
+            t_far = t1;
+        }
+        if (t_near > t_far)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 std::vector<intersect_result> aa_cube::intersect_all(const ray &r) const
+{
+    double t[6];
+    std::size_t faces[6];
+    std::size_t count = _intersections(r, t, faces);
+
+    std::vector<intersect_result> results;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        results.push_back(intersect_result(r.origin + r.direction * t[i], normals[faces[i]], t[i]));
+    }
+
+    // assert results.size() <= 2
+    return results;
+}
+
+std::size_t aa_cube::count_intersections(const ray &r, double t_min, double t_max,
+                                         std::size_t max_count) const
+{
+    double t[6];
+    std::size_t faces[6];
+    std::size_t count = _intersections(r, t, faces);
+
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < count && result < max_count; ++i)
+    {
+        if (t_min <= t[i] && t[i] < t_max)
+        {
+            ++result;
+        }
+    }
+    return result;
+}
+
+std::size_t aa_cube::_intersections(const ray &r, double t[6], std::size_t faces[6]) const
 {
     vector3df p2 = p + size;
     double intersection[6] { -1.0, -1.0, -1.0, -1.0, -1.0, -1.0 };
@@ -237,28 +311,28 @@ std::vector<intersect_result> aa_cube::intersect_all(const ray &r) const
         intersection[5] = (p.y - r.origin.y) / r.direction.y;
     }
 
-    std::vector<intersect_result> results;
-    for (int i = 0; i < 6; ++i)
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < 6; ++i)
     {
-        double &t = intersection[i];
-        if (t > eps)
+        double &ti = intersection[i];
+        if (ti > eps)
         {
-            intersect_result ir(r.origin + r.direction * t, normals[i], t);
+            vector3df hit = r.origin + r.direction * ti;
             if (((i == 0 || i == 1) &&
-                 p.x - eps < ir.p.x && ir.p.x < p2.x + eps &&
-                 p.y - eps < ir.p.y && ir.p.y < p2.y + eps) ||
+                 p.x - eps < hit.x && hit.x < p2.x + eps &&
+                 p.y - eps < hit.y && hit.y < p2.y + eps) ||
                 ((i == 2 || i == 3) &&
-                 p.y - eps < ir.p.y && ir.p.y < p2.y + eps &&
-                 p.z - eps < ir.p.z && ir.p.z < p2.z + eps) ||
+                 p.y - eps < hit.y && hit.y < p2.y + eps &&
+                 p.z - eps < hit.z && hit.z < p2.z + eps) ||
                 ((i == 4 || i == 5) &&
-                 p.x - eps < ir.p.x && ir.p.x < p2.x + eps &&
-                 p.z - eps < ir.p.z && ir.p.z < p2.z + eps))
+                 p.x - eps < hit.x && hit.x < p2.x + eps &&
+                 p.z - eps < hit.z && hit.z < p2.z + eps))
             {
-                results.push_back(ir);
+                t[count] = ti;
+                faces[count] = i;
+                ++count;
             }
         }
     }
-
-    // assert results.size() <= 2
-    return results;
+    return count;
 }
\ No newline at end of file
@@ -23,14 +23,27 @@ public:
                p.z - eps <= p0.z && p0.z <= p2.z + eps;
     }
 
+    double surface_area() const
+    {
+        return 2.0 * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
     intersect_result intersect(const ray &r) const;
+    // slab test, clips [t_near, t_far] to the part of the ray inside the cube
+    bool clip(const ray &r, double &t_near, double &t_far) const;
     std::vector<intersect_result> intersect_all(const ray &r) const;
+    std::size_t count_intersections(const ray &r, double t_min, double t_max,
+                                    std::size_t max_count) const;
 
     static constexpr std::size_t front = 0, back = 1,
                                  left = 2, right = 3,
                                  top = 4, bottom = 5,
                                  none = 6;
     static const vector3df normals[6];
+
+private:
+    // distances to the faces hit (at most 6, usually 2), returns the count
+    std::size_t _intersections(const ray &r, double t[6], std::size_t faces[6]) const;
 };
 
 #endif // _AA_CUBE_H_
\ No newline at end of file
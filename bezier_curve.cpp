@@ -1,34 +1,62 @@
 #include "bezier_curve.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cinttypes>
 
-vector3df bezier_curve::get_point(double t) const
+bezier_curve::bezier_curve(size_t n)
+    : data(n + 1), n(n), _binomials(n + 1), _d_binomials(std::max<std::size_t>(n, 1))
 {
-    // de Casteljau's algorithm
-    bezier_curve p = *this; // copy, k = 0
-    for (std::size_t k = 1; k <= n; ++k)
+    _binomials[0] = 1.0;
+    for (std::size_t i = 1; i <= n; ++i)
     {
-        for (std::size_t i = 0; i <= n - k; ++i)
-        {
-            p[i] = p[i] * (1 - t) + p[i + 1] * t;
-        }
+        _binomials[i] = _binomials[i - 1] * (double)(n - i + 1) / (double)i;
+    }
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        _d_binomials[i] = _binomials[i] * (double)(n - i); // n * C(n - 1, i)
     }
-    return p[0];
 }
 
-vector3df bezier_curve::d_dt(double t) const
+void bezier_curve::evaluate(double t, vector3df &out_point, vector3df &out_d_dt) const
 {
-    if (!_cache)
+    // Horner's rule on the Bernstein form, both sums in one pass:
+    //   P(t)  = sum C(n, i) t^i (1 - t)^(n - i) P[i]
+    //   P'(t) = sum n C(n - 1, i) t^i (1 - t)^(n - 1 - i) (P[i + 1] - P[i])
+    // as (((a0 s + a1 t) s + a2 t^2) s + ...), s = 1 - t, O(n) and stable
+    // on [0, 1] where de Casteljau's algorithm is O(n^2)
+    if (n == 0)
     {
-        _cache = std::unique_ptr<bezier_curve>(new bezier_curve(n - 1));
-        for (std::size_t i = 0; i <= n - 1; ++i)
-        {
-            _cache->data[i] = (data[i + 1] - data[i]) * (double)n;
-        }
+        out_point = data[0];
+        out_d_dt = vector3df::zero;
+        return;
+    }
+    const double s = 1 - t;
+    double ti = 1.0; // t^i
+    vector3df point = data[0] * s,
+              tangent = (data[1] - data[0]) * _d_binomials[0];
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        ti *= t;
+        point = (point + data[i] * (_binomials[i] * ti)) * s;
+        tangent = tangent * s + (data[i + 1] - data[i]) * (_d_binomials[i] * ti);
     }
+    out_point = point + data[n] * (ti * t);
+    out_d_dt = tangent;
+}
 
-    return _cache->get_point(t);
+vector3df bezier_curve::get_point(double t) const
+{
+    vector3df point, tangent;
+    evaluate(t, point, tangent);
+    return point;
+}
+
+vector3df bezier_curve::d_dt(double t) const
+{
+    vector3df point, tangent;
+    evaluate(t, point, tangent);
+    return tangent;
 }
 
 std::vector<vector3df> bezier_curve::to_points(double dt) const
@@ -132,11 +160,11 @@ void bezier_curve::get(double t, double theta, vector3df &out_point,
                        vector3df &out_d_dt, vector3df &out_d_dtheta) const
 {
     double cos_theta = cos(theta), sin_theta = sin(theta);
-    vector3df tangent = d_dt(t);
+    vector3df p, tangent;
+    evaluate(t, p, tangent);
     out_d_dt = vector3df(tangent.x * cos_theta,
                          tangent.y,
                          -tangent.x * sin_theta);
-    vector3df p = get_point(t);
     out_d_dtheta = vector3df(p.x * -sin_theta,
                              0.0,
                              -p.x * cos_theta);
@@ -2,7 +2,6 @@
 #define _BEZIER_CURVE_H_
 
 #include <cstddef>
-#include <memory>
 #include <vector>
 
 #include "object.h"
@@ -20,20 +19,11 @@ public:
     const std::size_t n;
 
 private:
-    mutable std::unique_ptr<bezier_curve> _cache = nullptr; // for derivatives
+    // C(n, i) and n * C(n - 1, i), for evaluate
+    std::vector<double> _binomials, _d_binomials;
 
 public:
-    bezier_curve(const bezier_curve &b)
-        : data(b.data), _cache(nullptr), n(b.n)
-    {
-
-    }
-
-    explicit bezier_curve(size_t n)
-        : data(n + 1), _cache(nullptr), n(n)
-    {
-
-    }
+    explicit bezier_curve(size_t n);
     
     vector3df &operator[](size_t i)
     {
@@ -47,6 +37,8 @@ public:
 
     vector3df get_point(double t) const;
     vector3df d_dt(double t) const;
+    // the point and the derivative at t, together
+    void evaluate(double t, vector3df &out_point, vector3df &out_d_dt) const;
     std::vector<vector3df> to_points(double dt) const;
     std::vector<vector3df> to_tangents(double dt) const;
     mesh to_rotate_surface_mesh(double dt, double dtheta) const;
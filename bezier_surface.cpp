@@ -1,57 +1,163 @@
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
 
 #include "bezier_surface.h"
 
-vector3df bezier_surface::get_point(double u, double v) const
+namespace
+{
+
+// The Bernstein polynomials of degree n at t, b[i] = C(n, i) t^i (1 - t)^(n - i),
+// and their derivatives, d[i] = n (b[n - 1, i - 1] - b[n - 1, i]). b and d
+// hold n + 1 values.
+void bernstein(std::size_t n, double t, double *b, double *d)
 {
-    // de Casteljau's algorithm
-    bezier_surface p = *this; // copy, k, l = 0
-    // k = 1, ..., m, l = 0
-    for (std::size_t k = 1; k < width; ++k)
+    // degree n - 1 first, row by row like Pascal's triangle
+    b[0] = 1.0;
+    for (std::size_t k = 1; k < n; ++k)
     {
-        for (std::size_t j = 0; j < height - 0; ++j)
+        b[k] = t * b[k - 1];
+        for (std::size_t i = k - 1; i > 0; --i)
         {
-            for (std::size_t i = 0; i < width - k; ++i)
-            {
-                p(i, j) = p(i, j) * (1 - u) + p(i + 1, j) * u;
-            }
+            b[i] = (1 - t) * b[i] + t * b[i - 1];
         }
+        b[0] *= 1 - t;
     }
-    // k = m, l = 1, ..., n
-    for (std::size_t l = 1; l < height; ++l)
+    if (n == 0)
     {
-        for (std::size_t j = 0; j < height - l; ++j)
+        d[0] = 0.0;
+        return;
+    }
+
+    d[0] = -(double)n * b[0];
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        d[i] = (double)n * (b[i - 1] - b[i]);
+    }
+    d[n] = (double)n * b[n - 1];
+
+    b[n] = t * b[n - 1];
+    for (std::size_t i = n - 1; i > 0; --i)
+    {
+        b[i] = (1 - t) * b[i] + t * b[i - 1];
+    }
+    b[0] *= 1 - t;
+}
+
+}
+
+vector3df bezier_surface::get_point(double u, double v) const
+{
+    vector3df point, d_du, d_dv;
+    get(u, v, point, d_du, d_dv);
+    return point;
+}
+
+void bezier_surface::get(double u, double v, vector3df &out_point,
+                         vector3df &out_d_du, vector3df &out_d_dv) const
+{
+    std::vector<double> bu(width), dbu(width), bv(height), dbv(height);
+    bernstein(width - 1, u, bu.data(), dbu.data());
+    bernstein(height - 1, v, bv.data(), dbv.data());
+    out_point = out_d_du = out_d_dv = vector3df::zero;
+    for (std::size_t y = 0; y < height; ++y)
+    {
+        for (std::size_t x = 0; x < width; ++x)
         {
-            // for (std::size_t i = 0; i < width - (width - 1); ++i)
-            p(0, j) = p(0, j) * (1 - v) + p(0, j + 1) * v;
+            const vector3df &p = (*this)(x, y);
+            out_point += p * (bu[x] * bv[y]);
+            out_d_du += p * (dbu[x] * bv[y]);
+            out_d_dv += p * (bu[x] * dbv[y]);
         }
     }
-    return p(0, 0);
 }
 
-mesh bezier_surface::to_mesh(double du, double dv) const
+mesh bezier_surface::to_mesh(double du, double dv, std::size_t thread_count) const
 {
     mesh result;
 
     std::size_t nu = 1.0 / du + 1, nv = 1.0 / dv + 1;
-    std::size_t pid = 0; // point index
-    double u = 0.0, v = 0.0;
+    result.vertices.resize(nu * nv);
+    result.normals.resize(nu * nv);
+    result.texture.resize(nu * nv);
+    result.surfaces.resize((nu - 1) * (nv - 1) * 2);
+
+    // The basis at every u and v of the grid, once. A row of the grid is
+    // then a curve: its control points (and those of d/dv) are the columns
+    // of the control grid weighted by the v basis, and every point of the
+    // row is a dot product of the u basis with them.
+    std::vector<double> u_basis(nu * width), u_d_basis(nu * width),
+                        v_basis(nv * height), v_d_basis(nv * height);
+    for (std::size_t i = 0; i < nu; ++i)
+    {
+        bernstein(width - 1, i * du, &u_basis[i * width], &u_d_basis[i * width]);
+    }
     for (std::size_t j = 0; j < nv; ++j)
     {
-        u = 0.0;
-        for (std::size_t i = 0; i < nu; ++i)
+        bernstein(height - 1, j * dv, &v_basis[j * height], &v_d_basis[j * height]);
+    }
+
+    std::atomic<std::size_t> next_row(0);
+    auto tessellate = [&]()
+    {
+        std::vector<vector3df> row(width), row_d_dv(width);
+        for (std::size_t j = next_row++; j < nv; j = next_row++)
         {
-            vector3df p = get_point(u, v);
-            result.vertices.push_back(p);
-            if (i > 0 && j > 0)
+            const double *bv = &v_basis[j * height], *dbv = &v_d_basis[j * height];
+            for (std::size_t x = 0; x < width; ++x)
             {
-                result.surfaces.push_back(vector3di(pid - 1, pid - nv - 1, pid - nv));
-                result.surfaces.push_back(vector3di(pid - 1, pid - nv, pid));
+                row[x] = row_d_dv[x] = vector3df::zero;
+                for (std::size_t y = 0; y < height; ++y)
+                {
+                    row[x] += (*this)(x, y) * bv[y];
+                    row_d_dv[x] += (*this)(x, y) * dbv[y];
+                }
+            }
+
+            for (std::size_t i = 0; i < nu; ++i)
+            {
+                const double *bu = &u_basis[i * width], *dbu = &u_d_basis[i * width];
+                vector3df p, d_du, d_dv;
+                for (std::size_t x = 0; x < width; ++x)
+                {
+                    p += row[x] * bu[x];
+                    d_du += row[x] * dbu[x];
+                    d_dv += row_d_dv[x] * bu[x];
+                }
+                vector3df n = d_du.cross(d_dv);
+                if (n.length2() < eps2)
+                {
+                    // degenerate, e.g. an edge of the control grid collapsed
+                    // into a point: the normal from next to it
+                    const double nudge = 1e-4;
+                    vector3df q;
+                    get(i * du + (i * du < 0.5 ? nudge : -nudge),
+                        j * dv + (j * dv < 0.5 ? nudge : -nudge), q, d_du, d_dv);
+                    n = d_du.cross(d_dv);
+                }
+
+                const std::size_t pid = j * nu + i; // point index
+                result.vertices[pid] = p;
+                result.normals[pid] = n.normalize();
+                result.texture[pid] = vector3df(i * du, j * dv, 0.0);
+                if (i > 0 && j > 0)
+                {
+                    const std::size_t sid = ((j - 1) * (nu - 1) + i - 1) * 2;
+                    result.surfaces[sid] = vector3di(pid - 1, pid - nu - 1, pid - nu);
+                    result.surfaces[sid + 1] = vector3di(pid - 1, pid - nu, pid);
+                }
             }
-            ++pid;
-            u += du;
         }
-        v += dv;
+    };
+    std::vector<std::shared_ptr<std::thread> > threads;
+    for (std::size_t i = 1; i < std::min(thread_count, nv); ++i)
+    {
+        threads.push_back(std::make_shared<std::thread>(tessellate));
+    }
+    tessellate();
+    for (auto &t : threads)
+    {
+        t->join();
     }
     return result;
 }
@@ -3,6 +3,7 @@
 
 #include <cstddef>
 #include <memory>
+#include <thread>
 #include <vector>
 
 #include "vector3d.hpp"
@@ -35,7 +36,12 @@ public:
     }
 
     vector3df get_point(double u, double v) const;
-    mesh to_mesh(double du, double dv) const;
+    // the point and the partial derivatives at (u, v)
+    void get(double u, double v, vector3df &out_point,
+             vector3df &out_d_du, vector3df &out_d_dv) const;
+    // with normals and texture coordinates, rows in parallel
+    mesh to_mesh(double du, double dv,
+                 std::size_t thread_count = std::thread::hardware_concurrency()) const;
 
     static bezier_surface load(const std::string &filename);
 };
@@ -1,23 +1,31 @@
+#include <atomic>
 #include <cstddef>
 #include <cstdio>
-#include <ctime>
 #include <random>
-#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
 
 #include "camera.h"
 
 #include "light.h"
+#include "rng.h"
+#include "work_stealing.h"
 
-static std::default_random_engine engine(time(nullptr));
-
-vector3df camera::ray_trace(const ray &r, const vector3df &contribution)
+vector3df camera::ray_trace(const ray &r, const vector3df &contribution,
+                            hit_point_store &hit_points)
 {
     if (contribution.length2() < eps)
     {
         return vector3df::zero;
     }
 
-    world_intersect_result ir = w.intersect(r);
+    return _shade(r, w.intersect(r), contribution, hit_points);
+}
+
+vector3df camera::_shade(const ray &r, const world_intersect_result &ir, const vector3df &contribution,
+                         hit_point_store &hit_points)
+{
     if (!ir.succeeded)
     {
         return vector3df::zero;
@@ -25,13 +33,7 @@ vector3df camera::ray_trace(const ray &r, const vector3df &contribution)
 
     if (ir.obj.diffuse.length2() > eps2)
     {
-        hit_point hp(r, ir.obj, ir.result);
-        hp.contribution = contribution * (1 - ir.obj.reflectiveness);
-
-        {
-            std::unique_lock<std::mutex> lock(_hit_points_lock);
-            _hit_points.push_back(hp);
-        }
+        hit_points.push_back(r, ir.obj, ir.result, contribution * (1 - ir.obj.reflectiveness));
     }
 
     vector3df I = vector3df::zero;
@@ -67,7 +69,7 @@ vector3df camera::ray_trace(const ray &r, const vector3df &contribution)
 
             vector3df Irefract =
                 ray_trace(ray(r, ir.result.p, new_direction, in_out, n_r),
-                    contribution.modulate(refractiveness)).modulate(refractiveness);
+                    contribution.modulate(refractiveness), hit_points).modulate(refractiveness);
             I += Irefract;
         }
         else // total reflection
@@ -79,7 +81,7 @@ vector3df camera::ray_trace(const ray &r, const vector3df &contribution)
     if (reflectiveness.length2() > eps2)
     {
         vector3df Ireflect = ray_trace(ray(r, ir.result.p, r.direction.reflect(ir.result.n)),
-            contribution.modulate(reflectiveness)).modulate(reflectiveness);
+            contribution.modulate(reflectiveness), hit_points).modulate(reflectiveness);
         I += Ireflect;
     }
 
@@ -87,7 +89,8 @@ vector3df camera::ray_trace(const ray &r, const vector3df &contribution)
 }
 
 void camera::photon_trace(const ray &r, const vector3df &contribution, double radius,
-                          std::size_t depth)
+                          std::default_random_engine &engine,
+                          photon_tally &tally, std::size_t depth)
 {
     if (depth > diffuse_depth)
     {
@@ -107,24 +110,31 @@ void camera::photon_trace(const ray &r, const vector3df &contribution, double ra
 
     if (ir.obj.diffuse.length2() > eps2)
     {
-        std::vector<unsigned int> hit_point_ids =
-            _hit_point_inside(sphere(ir.result.p, radius));
-        for (const auto &i : hit_point_ids)
+        auto deposit = [&] (unsigned int i)
         {
-            hit_point &hp = _hit_points[i];
-            if ((ir.result.p - hp.p).length2() > hp.radius2)
+            if ((ir.result.p - _hit_points.positions[i].p).length2() > _hit_points.radius2[i])
             {
-                continue;
+                return;
             }
 
-            vector3df flux = hp.obj->brdf(_to_intersect_result(hp),
-                                          hp.ray_direction,
+            const hit_shading &hs = _hit_points.shading[i];
+            vector3df flux = hs.obj->brdf(_hit_points.to_intersect_result(i),
+                                          hs.ray_direction,
                                           r.direction).modulate(contribution);
+            tally.add(i, flux); // merged after the pass
+        };
 
+        if (use_hash_grid)
+        {
+            _grid.query(ir.result.p, radius, deposit);
+        }
+        else
+        {
+            std::vector<unsigned int> hit_point_ids =
+                _hit_point_inside(sphere(ir.result.p, radius));
+            for (const auto &i : hit_point_ids)
             {
-                std::unique_lock<std::mutex> lock(_hit_points_lock);
-                ++hp.new_photon_count;
-                hp.flux += flux;
+                deposit(i);
             }
         }
 
@@ -138,7 +148,7 @@ void camera::photon_trace(const ray &r, const vector3df &contribution, double ra
         vector3df dir = x * (sin(theta) * cos(phi)) + y * (sin(theta) * sin(phi)) + z * cos(theta);
         photon_trace(ray(r, ir.result.p, dir),
                      contribution.modulate(ir.obj.get_diffuse(ir.result)),
-                     radius, depth + 1);
+                     radius, engine, tally, depth + 1);
     }
 
     vector3df reflectiveness = vector3df::one * ir.obj.reflectiveness;
@@ -171,7 +181,7 @@ void camera::photon_trace(const ray &r, const vector3df &contribution, double ra
             reflectiveness = reflectiveness * R;
 
             photon_trace(ray(r, ir.result.p, new_direction, in_out, n_r),
-                         contribution.modulate(refractiveness), radius, depth);
+                         contribution.modulate(refractiveness), radius, engine, tally, depth);
         }
         else // total reflection
         {
@@ -182,80 +192,218 @@ void camera::photon_trace(const ray &r, const vector3df &contribution, double ra
     if (reflectiveness.length2() > eps2)
     {
         photon_trace(ray(r, ir.result.p, r.direction.reflect(ir.result.n)),
-                     contribution.modulate(reflectiveness), radius, depth);
+                     contribution.modulate(reflectiveness), radius, engine, tally, depth);
     }
 }
 
 void camera::ray_trace_pass(imagef &img)
+{
+    _ray_trace_pass(img, false, 0);
+}
+
+void camera::_ray_trace_pass(imagef &img, bool jitter, std::uint64_t pass)
 {
     _hit_points.clear();
+    _pixel_begin.clear();
+    _kdt = kd_tree<hit_position>();
+    _grid = hash_grid();
+    _photon_passes = 0;
 
-    double aperture_samples2 = aperture_samples * aperture_samples;
     double delta = (double)aperture / aperture_samples;
 
-    std::ptrdiff_t progress = 0;
+    const std::size_t tile = tile_size > 0 ? tile_size : 1;
+    const std::size_t tiles_x = (img.width + tile - 1) / tile,
+                      tiles_y = (img.height + tile - 1) / tile,
+                      tile_count = tiles_x * tiles_y;
+    thread_pool &pool = _threads();
+    work_stealing_queue tiles(tile_count, pool.size());
+    std::vector<double> tile_seconds(tile_count, 0.0), busy_seconds(pool.size(), 0.0);
+
+    // Every thread appends to its own store, about one hit point per eye ray.
+    // Tile t is [tile_begin[t], tile_end[t]) of the store of tile_thread[t].
+    const std::size_t samples = aperture != 0.0 && !jitter ? aperture_samples * aperture_samples : 1;
+    std::vector<hit_point_store> thread_hit_points(pool.size());
+    for (auto &hit_points : thread_hit_points)
+    {
+        hit_points.reserve(img.width * img.height * samples / pool.size());
+    }
+    std::vector<std::size_t> tile_thread(tile_count), tile_begin(tile_count), tile_end(tile_count);
+
+    std::atomic<std::size_t> progress(0);
     double half_width = (double)film_width / 2.0, half_height = (double)film_height / 2.0;
-    auto task = [&] (std::ptrdiff_t begin, std::ptrdiff_t end, bool print_progress)
-    {
-        for (std::ptrdiff_t y = begin; y < end; ++y)
+    // Primary rays are traced a tile row at a time. With use_packets, a packet
+    // holds the same aperture sample of neighbouring pixels, so its rays share
+    // the origin unless jittered. The hits are shaded as single rays in the
+    // order of the rays, every ray adds its share of the pixel.
+    const vector3df contribution = vector3df::one / (double)samples;
+    auto task = [&] (std::size_t thread_id, bool print_progress)
+    {
+        hit_point_store &hit_points = thread_hit_points[thread_id];
+        std::vector<ray> row_rays;
+        row_rays.reserve(tile * samples);
+        std::vector<object *> row_objs(tile * samples);
+        std::vector<intersect_result> row_results(tile * samples);
+        ray_packet packet;
+        object *packet_objs[ray_packet::max_size];
+        intersect_result packet_results[ray_packet::max_size];
+        std::size_t index;
+        while (tiles.next(thread_id, index))
         {
-            for (std::ptrdiff_t x = 0; x < img.width; ++x)
+            auto start_time = std::chrono::steady_clock::now();
+            tile_thread[index] = thread_id;
+            tile_begin[index] = hit_points.size();
+            // seeded by tile, not by thread, another stream than the photons
+            std::default_random_engine engine(mix_seed(mix_seed(~seed, pass), index));
+            std::uniform_real_distribution<double> dist(0.0, 1.0);
+            const std::ptrdiff_t x0 = (index % tiles_x) * tile, y0 = (index / tiles_x) * tile;
+            const std::ptrdiff_t x1 = std::min<std::ptrdiff_t>(x0 + tile, img.width),
+                                 y1 = std::min<std::ptrdiff_t>(y0 + tile, img.height);
+            for (std::ptrdiff_t y = y0; y < y1; ++y)
             {
-                const double world_x = (double)x * film_width / img.width,
-                             world_y = (double)(img.height - y - 1) * film_height / img.height;
-                vector3df color = vector3df::zero;
-                const vector3df d = right * (double)(world_x - half_width) +
-                                up * (double)(world_y - half_height) +
-                                front * (double)(focal_length);
-                if (aperture != 0.0)
+                row_rays.clear();
+                for (std::ptrdiff_t x = x0; x < x1; ++x)
+                {
+                    double sample_x = 0.0, sample_y = 0.0; // within the pixel
+                    if (jitter)
+                    {
+                        sample_x = dist(engine);
+                        sample_y = dist(engine);
+                    }
+                    const double world_x = (x + sample_x) * film_width / img.width,
+                                 world_y = (img.height - y - 1 + sample_y) * film_height / img.height;
+                    const vector3df d = right * (double)(world_x - half_width) +
+                                    up * (double)(world_y - half_height) +
+                                    front * (double)(focal_length);
+                    if (aperture != 0.0 && jitter) // one random point of the aperture
+                    {
+                        const vector3df t = location + d;
+                        const double u = dist(engine) - 0.5, v = dist(engine) - 0.5;
+                        const vector3df o = location + right * (u * aperture) + up * (v * aperture);
+                        row_rays.push_back(ray(o, (t - o).normalize(), x, y));
+                    }
+                    else if (aperture != 0.0)
+                    {
+                        const vector3df t = location + d;
+                        // samples
+                        vector3df o_y = location + up * (-aperture / 2.0) + right * (-aperture / 2.0);
+                        for (std::ptrdiff_t sample_y = 0; sample_y < aperture_samples; ++sample_y)
+                        {
+                            vector3df o = o_y;
+                            for (std::ptrdiff_t sample_x = 0; sample_x < aperture_samples; ++sample_x)
+                            {
+                                // o = location + right * (-aperture / 2.0 + sample_x * delta) +
+                                //                up * (-aperture / 2.0 + sample_y * delta)
+                                row_rays.push_back(ray(o, (t - o).normalize(), x, y));
+                                o += right * delta;
+                            }
+                            o_y += up * delta;
+                        }
+                    }
+                    else // no depth of field
+                    {
+                        row_rays.push_back(ray(location, d.normalize(), x, y));
+                    }
+                }
+
+                const std::size_t pixels = x1 - x0;
+                if (contribution.length2() < eps) // as in ray_trace
+                {
+                    std::fill(row_objs.begin(), row_objs.end(), nullptr);
+                }
+                else if (!use_packets)
+                {
+                    for (std::size_t j = 0; j < pixels * samples; ++j)
+                    {
+                        world_intersect_result wr = w.intersect(row_rays[j]);
+                        row_objs[j] = wr.succeeded ? &wr.obj : nullptr;
+                        row_results[j] = wr.result;
+                    }
+                }
+                else
                 {
-                    const vector3df t = location + d;
-                    // samples
-                    vector3df o_y = location + up * (-aperture / 2.0) + right * (-aperture / 2.0);
-                    for (std::ptrdiff_t sample_y = 0; sample_y < aperture_samples; ++sample_y)
+                    for (std::size_t sample = 0; sample < samples; ++sample)
                     {
-                        vector3df o = o_y;
-                        for (std::ptrdiff_t sample_x = 0; sample_x < aperture_samples; ++sample_x)
+                        for (std::size_t begin = 0; begin < pixels; begin += ray_packet::max_size)
                         {
-                            // o = location + right * (-aperture / 2.0 + sample_x * delta) +
-                            //                up * (-aperture / 2.0 + sample_y * delta)
-                            const ray r = ray(o, (t - o).normalize(), x, y);
-                            color += ray_trace(r, vector3df::one / aperture_samples2) /
-                                     aperture_samples2;
-                            o += right * delta;
+                            const std::size_t end = std::min(begin + ray_packet::max_size, pixels);
+                            packet.clear();
+                            for (std::size_t i = begin; i < end; ++i)
+                            {
+                                packet.push_back(row_rays[i * samples + sample]);
+                            }
+                            w.intersect_packet(packet, packet_objs, packet_results);
+                            for (std::size_t i = begin; i < end; ++i)
+                            {
+                                row_objs[i * samples + sample] = packet_objs[i - begin];
+                                row_results[i * samples + sample] = packet_results[i - begin];
+                            }
                         }
-                        o_y += up * delta;
                     }
                 }
-                else // no depth of field
+
+                for (std::size_t i = 0; i < pixels; ++i)
                 {
-                    const ray r = ray(location, d.normalize(), x, y);
-                    color = ray_trace(r, vector3df::one);
+                    vector3df color = vector3df::zero;
+                    for (std::size_t sample = 0; sample < samples; ++sample)
+                    {
+                        const std::size_t j = i * samples + sample;
+                        if (row_objs[j])
+                        {
+                            color += _shade(row_rays[j], world_intersect_result(*row_objs[j], row_results[j]),
+                                            contribution, hit_points) / (double)samples;
+                        }
+                    }
+                    img(x0 + i, y) = color.capped();
                 }
-                img(x, y) = color.capped();
             }
-            ++progress;
+            tile_end[index] = hit_points.size();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+            tile_seconds[index] = elapsed.count();
+            busy_seconds[thread_id] += elapsed.count();
+            std::size_t done = ++progress;
             if (print_progress)
             {
-                fprintf(stderr, "\rRay tracing... %5.2lf%%", (double)progress * 100.0 / img.height);
+                fprintf(stderr, "\rRay tracing... %5.2lf%%", (double)done * 100.0 / tile_count);
             }
         }
     };
 
-    std::vector<std::shared_ptr<std::thread> > tasks;
-    std::size_t chunk_size = img.height / thread_count;
-    for (std::size_t i = 0; i < thread_count - 1; ++i)
+    pool.run([&] (std::size_t thread_id)
     {
-        tasks.push_back(std::make_shared<std::thread>(task, i * chunk_size, (i + 1) * chunk_size, true));
+        task(thread_id, thread_id == pool.size() - 1);
+    });
+    
+    fprintf(stderr, "\n");
+
+    if (tile_count > 0)
+    {
+        std::size_t slowest = std::max_element(tile_seconds.begin(), tile_seconds.end()) -
+                              tile_seconds.begin();
+        double total = 0.0;
+        for (double seconds : tile_seconds)
+        {
+            total += seconds;
+        }
+        auto busy = std::minmax_element(busy_seconds.begin(), busy_seconds.end());
+        printf("%lu tiles (%lux%lu), %.2lf ms avg, %.2lf ms max (tile %lu, %lu), "
+               "thread busy %.3lf-%.3lf s\n",
+               tile_count, tile, tile, total * 1000.0 / tile_count, tile_seconds[slowest] * 1000.0,
+               slowest % tiles_x, slowest / tiles_x, *busy.first, *busy.second);
     }
-    task(chunk_size * (thread_count - 1), img.height, true);
-    for (std::size_t i = 0; i < thread_count - 1; ++i)
+
+    // concatenate in tile order, independent of which thread took which tile
+    std::size_t hit_point_count = 0;
+    for (const auto &hit_points : thread_hit_points)
     {
-        tasks[i]->join();
+        hit_point_count += hit_points.size();
     }
-    
-    fprintf(stderr, "\n");
-    printf("%lu hit points\n", _hit_points.size());
+    _hit_points.reserve(hit_point_count);
+    for (std::size_t i = 0; i < tile_count; ++i)
+    {
+        _hit_points.append(thread_hit_points[tile_thread[i]], tile_begin[i], tile_end[i]);
+    }
+    printf("%lu hit points (%.1lf MB)\n", _hit_points.size(),
+           _hit_points.memory_usage() / 1048576.0);
 }
 
 double camera::photon_trace_pass(int photon_count, double radius)
@@ -264,74 +412,43 @@ double camera::photon_trace_pass(int photon_count, double radius)
 
     bool is_first_pass = false;
 
-    if (!_kdt.root)
+    if (_photon_passes == 0)
     {
-        printf("Building kd-tree (hit points)...\n");
-        _kdt = kd_tree<hit_point>::build(_hit_points.begin(), _hit_points.end(), true);
-        for (auto &hp : _hit_points)
+        for (auto &radius2 : _hit_points.radius2)
         {
-            hp.radius2 = radius * radius;
+            radius2 = radius * radius;
         }
         is_first_pass = true;
     }
 
-    // emit rays
-    std::size_t progress = 0;
-    auto task = [&] (std::size_t begin, std::size_t end, bool print_progress)
-    {
-        for (std::size_t i = begin; i < end; ++i)
-        {
-            // choose a light
-            std::uniform_int_distribution<std::size_t> dist(0, w.lights.size() - 1);
-            light &l = *w.lights[dist(engine)];
-            ray r = l.emit(engine);
-            photon_trace(r, l.flux(), radius);
-            ++progress;
-            if (print_progress && (progress & 1023) == 0)
-            {
-                fprintf(stderr, "\rPhoton tracing... %5.2lf%%",
-                        (double)progress * 100.0 / photon_count);
-            }
-        }
-    };
-
-    std::vector<std::shared_ptr<std::thread> > tasks;
-    std::size_t chunk_size = photon_count / thread_count;
-    for (std::size_t i = 0; i < thread_count - 1; ++i)
-    {
-        tasks.push_back(std::make_shared<std::thread>(task, i * chunk_size, (i + 1) * chunk_size, true));
-    }
-    task(chunk_size * (thread_count - 1), photon_count, true);
-    for (std::size_t i = 0; i < thread_count - 1; ++i)
-    {
-        tasks[i]->join();
-    }
-
-    fprintf(stderr, "\n");
+    _emit_photons(photon_count, radius, _photon_passes);
+    ++_photon_passes;
 
     if (!is_first_pass)
     {
         double max_radius2 = 0.0, min_radius2 = 1e6;
-        for (auto &hp : _hit_points)
+        for (std::size_t i = 0; i < _hit_points.size(); ++i)
         {
-            double coeff = (hp.photon_count + alpha * hp.new_photon_count) /
-                           (hp.photon_count + hp.new_photon_count);
-            if (hp.photon_count + hp.new_photon_count == 0)
+            hit_statistics &hs = _hit_points.statistics[i];
+            double &radius2 = _hit_points.radius2[i];
+            double coeff = (hs.photon_count + alpha * hs.new_photon_count) /
+                           (hs.photon_count + hs.new_photon_count);
+            if (hs.photon_count + hs.new_photon_count == 0)
             {
                 coeff = 1.0;
             }
-            hp.radius2 *= coeff;
-            if (hp.radius2 > max_radius2)
+            radius2 *= coeff;
+            if (radius2 > max_radius2)
             {
-                max_radius2 = hp.radius2;
+                max_radius2 = radius2;
             }
-            else if (hp.radius2 < min_radius2)
+            else if (radius2 < min_radius2)
             {
-                min_radius2 = hp.radius2;
+                min_radius2 = radius2;
             }
-            hp.flux = hp.flux * coeff;
-            hp.photon_count += alpha * hp.new_photon_count;
-            hp.new_photon_count = 0;
+            hs.flux = hs.flux * coeff;
+            hs.photon_count += alpha * hs.new_photon_count;
+            hs.new_photon_count = 0;
         }
         printf("max radius %lf\n", sqrt(max_radius2));
         printf("min radius %lf\n", sqrt(min_radius2));
@@ -339,15 +456,99 @@ double camera::photon_trace_pass(int photon_count, double radius)
     }
     else
     {
-        for (auto &hp : _hit_points)
+        for (auto &hs : _hit_points.statistics)
         {
-            hp.photon_count = hp.new_photon_count;
-            hp.new_photon_count = 0;
+            hs.photon_count = hs.new_photon_count;
+            hs.new_photon_count = 0;
         }
         return radius;
     }
 }
 
+void camera::_emit_photons(int photon_count, double radius, std::uint64_t pass)
+{
+    if (!use_hash_grid && _kdt.empty())
+    {
+        printf("Building kd-tree (hit points)...\n");
+        _kdt = kd_tree<hit_position>::build_in_place(_hit_points.positions, true, thread_count);
+    }
+
+    // cells only need to shrink with the radius once in a while
+    if (use_hash_grid && (_grid.empty() || radius > _grid.radius || radius < _grid.radius * 0.9))
+    {
+        printf("Building hash grid (hit points)...\n");
+        _grid.build(_hit_points.positions, radius);
+    }
+
+    // emit rays, every thread collects its own deposits
+    constexpr std::size_t bucket_count = 256;
+    const std::size_t bucket_size = _hit_points.size() / bucket_count + 1;
+    _tallies.resize(thread_count);
+    for (auto &tally : _tallies)
+    {
+        tally.bucket_size = bucket_size;
+        tally.buckets.resize(bucket_count);
+    }
+
+    auto begin_time = std::chrono::steady_clock::now();
+    std::size_t progress = 0;
+    auto task = [&] (std::size_t begin, std::size_t end, std::size_t thread_id,
+                     bool print_progress)
+    {
+        photon_tally &tally = _tallies[thread_id];
+        std::default_random_engine engine(mix_seed(mix_seed(seed, pass), thread_id));
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            // choose a light
+            std::uniform_int_distribution<std::size_t> dist(0, w.lights.size() - 1);
+            light &l = *w.lights[dist(engine)];
+            ray r = l.emit(engine);
+            photon_trace(r, l.flux(), radius, engine, tally);
+            ++progress;
+            if (print_progress && (progress & 1023) == 0)
+            {
+                fprintf(stderr, "\rPhoton tracing... %5.2lf%%",
+                        (double)progress * 100.0 / photon_count);
+            }
+        }
+    };
+
+    // a fixed share per thread, so every engine traces the same photons each run
+    std::size_t chunk_size = photon_count / thread_count;
+    _threads().run([&] (std::size_t thread_id)
+    {
+        std::size_t end = thread_id == thread_count - 1 ? photon_count :
+                                                          (thread_id + 1) * chunk_size;
+        task(thread_id * chunk_size, end, thread_id, true);
+    });
+
+    fprintf(stderr, "\n");
+
+    // merge a range of hit points at a time, in thread order within it as
+    // a serial merge would, and clear for the next pass
+    _threads().parallel_for(bucket_count, 1,
+                            [&] (std::size_t begin, std::size_t end, std::size_t)
+                            {
+                                for (std::size_t b = begin; b < end; ++b)
+                                {
+                                    for (auto &tally : _tallies)
+                                    {
+                                        for (const auto &d : tally.buckets[b])
+                                        {
+                                            hit_statistics &hs = _hit_points.statistics[d.index];
+                                            ++hs.new_photon_count;
+                                            hs.flux += d.flux;
+                                        }
+                                        tally.buckets[b].clear();
+                                    }
+                                }
+                            });
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                   begin_time).count();
+    printf("%.0lf photons/s (%lu threads)\n", photon_count / seconds, thread_count);
+}
+
 void camera::phong_estimate(imagef &img)
 {
     std::size_t progress = 0;
@@ -355,36 +556,39 @@ void camera::phong_estimate(imagef &img)
     {
         for (std::size_t i = begin; i < end; ++i)
         {
-            auto &hp = _hit_points[i];
+            const vector3df &p = _hit_points.positions[i].p;
+            const hit_shading &hs = _hit_points.shading[i];
+            const hit_pixel &hp = _hit_points.pixels[i];
+            const vector3df n = hs.n;
             vector3df Id = vector3df::zero, Is = vector3df::zero;
             for (auto &light_ptr : w.lights)
             {
-                light_info li = light_ptr->illuminate(hp.p);
+                light_info li = light_ptr->illuminate(p);
                 if (li.lightness == vector3df::zero)
                 {
                     continue;
                 }
 
-                double N_dot_L = li.direction.dot(-hp.n);
+                double N_dot_L = li.direction.dot(-n);
                 if (N_dot_L >= eps)
                 {
-                    Id += li.lightness.modulate(hp.obj->get_diffuse(_to_intersect_result(hp)) *
-                                                N_dot_L); // TODO: texture
+                    vector3df diffuse = hs.obj->get_diffuse(_hit_points.to_intersect_result(i));
+                    Id += li.lightness.modulate(diffuse * N_dot_L); // TODO: texture
                 }
 
-                vector3df R = -li.direction.reflect(hp.n);
-                double R_dot_V = R.dot(hp.ray_direction);
+                vector3df R = -li.direction.reflect(n);
+                double R_dot_V = R.dot(vector3df(hs.ray_direction));
                 if (R_dot_V >= eps)
                 {
-                    Is += li.lightness.modulate(hp.obj->specular * pow(R_dot_V, hp.obj->shininess));
+                    Is += li.lightness.modulate(hs.obj->specular * pow(R_dot_V, hs.obj->shininess));
                 }
             }
 
             vector3df I = Id + Is;
-            I = I.modulate(hp.contribution);
+            I = I.modulate(vector3df(hp.contribution));
 
             {
-                std::unique_lock<std::mutex> lock(_hit_points_lock);
+                std::unique_lock<std::mutex> lock(_image_lock);
                 img(hp.image_x, hp.image_y) = (img(hp.image_x, hp.image_y) + I).capped();
             }
 
@@ -397,49 +601,341 @@ void camera::phong_estimate(imagef &img)
         }
     };
 
-    std::vector<std::shared_ptr<std::thread> > tasks;
-    std::size_t chunk_size = _hit_points.size() / thread_count;
-    for (std::size_t i = 0; i < thread_count - 1; ++i)
+    _threads().parallel_for(_hit_points.size(), 1024,
+                            [&] (std::size_t begin, std::size_t end, std::size_t)
+                            {
+                                task(begin, end, true);
+                            });
+
+    fprintf(stderr, "\n");
+}
+
+void camera::ppm_estimate(imagef &img, std::uint64_t photon_count)
+{
+    if (!photon_count)
     {
-        tasks.push_back(std::make_shared<std::thread>(task, i * chunk_size, (i + 1) * chunk_size, true));
+        return;
     }
-    task(chunk_size * (thread_count - 1), _hit_points.size(), true);
-    for (std::size_t i = 0; i < thread_count - 1; ++i)
+
+    // a pixel is only written by the thread owning its row
+    _index_pixels(img.width, img.height);
+    std::atomic<std::size_t> progress(0);
+    _threads().parallel_for(img.height, 8,
+                            [&] (std::size_t begin, std::size_t end, std::size_t)
     {
-        tasks[i]->join();
+        for (std::size_t pixel = begin * img.width; pixel < end * img.width; ++pixel)
+        {
+            vector3df &color = img.raw[pixel];
+            for (unsigned int j = _pixel_begin[pixel]; j < _pixel_begin[pixel + 1]; ++j)
+            {
+                const std::size_t i = _pixel_hit_points[j];
+                vector3df I = _hit_points.statistics[i].flux /
+                              (M_PI * _hit_points.radius2[i] * photon_count);
+                I = I.modulate(vector3df(_hit_points.pixels[i].contribution));
+                color = (color + I).capped();
+            }
+        }
+        std::size_t done = progress += end - begin;
+        fprintf(stderr, "\rEstimating diffuse using PPM... %5.2lf%%",
+                (double)done * 100.0 / img.height);
+    });
+    fprintf(stderr, "\n");
+}
+
+double camera::sppm_iteration(std::size_t width, std::size_t height, int photon_count,
+                              double initial_radius)
+{
+    constexpr double alpha = 0.7;
+
+    if (_sppm_pixels.size() != width * height || _sppm_width != width)
+    {
+        sppm_pixel initial;
+        initial.radius2 = initial_radius * initial_radius;
+        _sppm_pixels.assign(width * height, initial);
+        _sppm_width = width;
+        _sppm_iterations = 0;
+        _sppm_photons = 0;
     }
 
-    fprintf(stderr, "\n");
+    // eye pass, only this iteration's hit points are kept
+    imagef eye(width, height);
+    _ray_trace_pass(eye, true, _sppm_iterations);
+    double max_radius2 = 0.0;
+    for (std::size_t i = 0; i < _hit_points.size(); ++i)
+    {
+        const hit_pixel &hp = _hit_points.pixels[i];
+        _hit_points.radius2[i] = _sppm_pixels[hp.image_y * width + hp.image_x].radius2;
+        max_radius2 = std::max(max_radius2, _hit_points.radius2[i]);
+    }
+
+    _emit_photons(photon_count, sqrt(max_radius2), _sppm_iterations);
+
+    // all hit points of a pixel share its radius and statistics
+    std::vector<double> new_photon_count(_sppm_pixels.size(), 0.0);
+    std::vector<vector3df> new_flux(_sppm_pixels.size(), vector3df::zero);
+    for (std::size_t i = 0; i < _hit_points.size(); ++i)
+    {
+        const hit_pixel &hp = _hit_points.pixels[i];
+        const hit_statistics &hs = _hit_points.statistics[i];
+        std::size_t pixel = hp.image_y * width + hp.image_x;
+        new_photon_count[pixel] += hs.new_photon_count;
+        new_flux[pixel] += hs.flux.modulate(vector3df(hp.contribution));
+    }
+
+    double max_radius = 0.0;
+    for (std::size_t y = 0; y < height; ++y)
+    {
+        for (std::size_t x = 0; x < width; ++x)
+        {
+            const std::size_t pixel = y * width + x;
+            sppm_pixel &p = _sppm_pixels[pixel];
+            p.direct += eye(x, y);
+            if (new_photon_count[pixel] > 0.0)
+            {
+                double count = p.photon_count + alpha * new_photon_count[pixel];
+                double coeff = count / (p.photon_count + new_photon_count[pixel]);
+                p.radius2 *= coeff;
+                p.flux = (p.flux + new_flux[pixel]) * coeff;
+                p.photon_count = count;
+            }
+            max_radius = std::max(max_radius, sqrt(p.radius2));
+        }
+    }
+
+    ++_sppm_iterations;
+    _sppm_photons += photon_count;
+    printf("SPPM iteration %lu, %lu hit points, max radius %lf\n",
+           _sppm_iterations, _hit_points.size(), max_radius);
+    return max_radius;
 }
 
-void camera::ppm_estimate(imagef &img, int photon_count)
+void camera::sppm_estimate(imagef &img)
 {
-    if (!photon_count)
+    if (!_sppm_iterations)
     {
         return;
     }
 
-    for (std::size_t i = 0; i < _hit_points.size(); ++i)
+    if (img.width != _sppm_width || img.width * img.height != _sppm_pixels.size())
     {
-        auto &hp = _hit_points[i];
-        
-        vector3df I = hp.flux / (M_PI * hp.radius2 * photon_count);
-        I = I.modulate(hp.contribution);
-        img(hp.image_x, hp.image_y) = (img(hp.image_x, hp.image_y) + I).capped();
-        if ((i & 1023) == 0)
+        fprintf(stderr, "SPPM statistics are not of a %lux%lu image\n",
+                img.width, img.height);
+        return;
+    }
+
+    _threads().parallel_for(img.height, 8,
+                            [&] (std::size_t begin, std::size_t end, std::size_t)
+    {
+        for (std::size_t y = begin; y < end; ++y)
         {
-            fprintf(stderr, "\rEstimating diffuse using PPM... %5.2lf%%",
-                    (double)(i + 1) * 100.0 / _hit_points.size());
+            for (std::size_t x = 0; x < img.width; ++x)
+            {
+                const sppm_pixel &p = _sppm_pixels[y * _sppm_width + x];
+                vector3df I = p.direct / _sppm_iterations +
+                              p.flux / (M_PI * p.radius2 * _sppm_photons);
+                img(x, y) = I.capped();
+            }
         }
+    });
+}
+
+// hit_shading with the object as its index in the world
+struct saved_shading
+{
+    std::uint32_t obj;
+    vector3ds n;
+    vector3ds ray_direction;
+    float u, v;
+    std::uint32_t index;
+};
+
+bool camera::save_checkpoint(const std::string &filename, const imagef &img,
+                             const render_progress &progress) const
+{
+    auto begin_time = std::chrono::steady_clock::now();
+
+    checkpoint_writer writer(filename);
+    const std::uint32_t is_sppm = !_sppm_pixels.empty();
+    writer.write(is_sppm);
+    writer.write((std::uint64_t)img.width);
+    writer.write((std::uint64_t)img.height);
+    writer.write((std::uint64_t)w.object_count());
+    writer.write(w.fingerprint());
+    writer.write(progress);
+    if (is_sppm)
+    {
+        writer.write((std::uint64_t)_sppm_iterations);
+        writer.write(_sppm_photons);
+        writer.write_vector(_sppm_pixels);
     }
-    fprintf(stderr, "\n");
+    else
+    {
+        std::unordered_map<const object *, std::uint32_t> object_ids;
+        for (std::size_t i = 0; i < w.object_count(); ++i)
+        {
+            object_ids[&w.get_object(i)] = i;
+        }
+        std::vector<saved_shading> shading(_hit_points.size());
+        for (std::size_t i = 0; i < shading.size(); ++i)
+        {
+            const hit_shading &hs = _hit_points.shading[i];
+            shading[i] = saved_shading { object_ids[hs.obj], hs.n, hs.ray_direction,
+                                         hs.u, hs.v, hs.index };
+        }
+
+        writer.write((std::uint64_t)_photon_passes);
+        writer.write_vector(img.raw); // eye pass
+        writer.write_vector(_hit_points.positions);
+        writer.write_vector(_hit_points.radius2);
+        writer.write_vector(shading);
+        writer.write_vector(_hit_points.pixels);
+        writer.write_vector(_hit_points.statistics);
+    }
+    bool succeeded = writer.close();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                   begin_time).count();
+    printf("Checkpoint %s, %.1lf MB in %.3lf s\n", succeeded ? "written" : "failed",
+           writer.bytes() / 1048576.0, seconds);
+    return succeeded;
+}
+
+bool camera::load_checkpoint(const std::string &filename, bool sppm, imagef &img,
+                             render_progress &progress)
+{
+    checkpoint_reader reader(filename);
+    std::uint32_t is_sppm = 0;
+    std::uint64_t width = 0, height = 0, object_count = 0, fingerprint = 0;
+    reader.read(is_sppm);
+    reader.read(width);
+    reader.read(height);
+    reader.read(object_count);
+    reader.read(fingerprint);
+    if (!reader.good() || (bool)is_sppm != sppm || width != img.width || height != img.height ||
+        object_count != w.object_count() || fingerprint != w.fingerprint())
+    {
+        return false;
+    }
+
+    render_progress loaded;
+    reader.read(loaded);
+    const std::size_t pixel_count = img.width * img.height;
+    if (is_sppm)
+    {
+        std::uint64_t iterations = 0, photons = 0;
+        std::vector<sppm_pixel> pixels;
+        reader.read(iterations);
+        reader.read(photons);
+        reader.read_vector(pixels, pixel_count);
+        if (!reader.good() || pixels.size() != pixel_count)
+        {
+            return false;
+        }
+        _sppm_pixels.swap(pixels);
+        _sppm_width = img.width;
+        _sppm_iterations = iterations;
+        _sppm_photons = photons;
+    }
+    else
+    {
+        std::uint64_t photon_passes = 0;
+        std::vector<vector3df> eye;
+        hit_point_store hit_points;
+        std::vector<saved_shading> shading;
+        // no more hit points than eye rays can make, with some splitting
+        const std::size_t max_size = pixel_count * aperture_samples * aperture_samples * 64;
+        reader.read(photon_passes);
+        reader.read_vector(eye, pixel_count);
+        reader.read_vector(hit_points.positions, max_size);
+        reader.read_vector(hit_points.radius2, max_size);
+        reader.read_vector(shading, max_size);
+        reader.read_vector(hit_points.pixels, max_size);
+        reader.read_vector(hit_points.statistics, max_size);
+        const std::size_t size = hit_points.positions.size();
+        if (!reader.good() || eye.size() != pixel_count || hit_points.radius2.size() != size ||
+            shading.size() != size || hit_points.pixels.size() != size ||
+            hit_points.statistics.size() != size)
+        {
+            return false;
+        }
+
+        hit_points.shading.resize(size);
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            const saved_shading &ss = shading[i];
+            const hit_pixel &hp = hit_points.pixels[i];
+            if (ss.obj >= object_count || hp.image_x < 0 || hp.image_x >= (int)img.width ||
+                hp.image_y < 0 || hp.image_y >= (int)img.height)
+            {
+                return false;
+            }
+            hit_points.shading[i] = hit_shading { &w.get_object(ss.obj), ss.n, ss.ray_direction,
+                                                  ss.u, ss.v, ss.index };
+        }
+
+        img.raw.swap(eye);
+        _hit_points = std::move(hit_points);
+        _photon_passes = photon_passes;
+        _sppm_pixels.clear();
+    }
+
+    // lookup structures are rebuilt by the next pass
+    _kdt = kd_tree<hit_position>();
+    _grid = hash_grid();
+    _pixel_begin.clear();
+    progress = loaded;
+    return true;
+}
+
+void camera::_index_pixels(std::size_t width, std::size_t height)
+{
+    if (_pixel_begin.size() == width * height + 1 && _pixel_hit_points.size() == _hit_points.size())
+    {
+        return;
+    }
+
+    // counting sort by pixel, hit points of a pixel stay in order
+    _pixel_begin.assign(width * height + 1, 0);
+    for (const auto &hp : _hit_points.pixels)
+    {
+        ++_pixel_begin[hp.image_y * width + hp.image_x + 1];
+    }
+    for (std::size_t i = 0; i < width * height; ++i)
+    {
+        _pixel_begin[i + 1] += _pixel_begin[i];
+    }
+    std::vector<unsigned int> next(_pixel_begin.begin(), _pixel_begin.end() - 1);
+    _pixel_hit_points.resize(_hit_points.size());
+    for (std::size_t i = 0; i < _hit_points.size(); ++i)
+    {
+        const hit_pixel &hp = _hit_points.pixels[i];
+        _pixel_hit_points[next[hp.image_y * width + hp.image_x]++] = i;
+    }
+}
+
+thread_pool &camera::_threads()
+{
+    std::size_t count = thread_count > 0 ? thread_count : 1;
+    if (_pool.size() != count || _pool.pinned() != pin_threads)
+    {
+        _pool.resize(count, pin_threads);
+    }
+    return _pool;
 }
 
 std::vector<unsigned int> camera::_hit_point_inside(const sphere &r) const
 {
     // deduplicate
     std::vector<unsigned int> result;
-    _hit_point_inside(r, _kdt.root.get(), result);
+    if (!_kdt.empty())
+    {
+        vector3df delta = vector3df::one * r.r;
+        aa_cube big_cube(_kdt.range.p - delta, _kdt.range.size + delta * 2);
+        if (big_cube.is_inside(r.c))
+        {
+            _hit_point_inside(r, 0, result);
+        }
+    }
     std::vector<bool> added(_hit_points.size());
     for (std::size_t i = 0; i < _hit_points.size(); ++i)
     {
@@ -460,44 +956,31 @@ std::vector<unsigned int> camera::_hit_point_inside(const sphere &r) const
     return result_deduplicated;
 }
 
-void camera::_hit_point_inside(const sphere &r, kd_tree<hit_point>::node *node,
+void camera::_hit_point_inside(const sphere &r, std::size_t node,
                                std::vector<unsigned int> &result) const
 {
-    if (!node)
-    {
-        return;
-    }
-
-    vector3df delta = vector3df::one * r.r;
-    aa_cube big_cube(node->range.p - delta, node->range.size + delta * 2);
-
-    if (!big_cube.is_inside(r.c))
+    const kd_tree<hit_position>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
     {
+        // points within eps of the split plane are in both children
+        const double c = r.c.dim[n.split_dim()];
+        if (c - r.r < n.split + eps)
+        {
+            _hit_point_inside(r, node + 1, result);
+        }
+        if (c + r.r >= n.split - eps)
+        {
+            _hit_point_inside(r, n.index, result);
+        }
         return;
     }
 
-    if (node->left && node->right)
-    {
-        _hit_point_inside(r, node->left, result);
-        _hit_point_inside(r, node->right, result);
-    }
-    else if (node->left)
+    for (std::size_t i = n.index; i < n.index + n.size(); ++i)
     {
-        _hit_point_inside(r, node->left, result);
-    }
-    else if (node->right)
-    {
-        _hit_point_inside(r, node->right, result);
-    }
-    else
-    {
-        for (std::size_t i = 0; i < node->size; ++i)
+        const hit_position &hp = _hit_points.positions[_kdt.indices[i]];
+        if ((hp.p - r.c).length2() < r.r2)
         {
-            const hit_point &hp = _hit_points[node->points[i]];
-            if ((hp.p - r.c).length2() < r.r2)
-            {
-                result.push_back(node->points[i]);
-            }
+            result.push_back(_kdt.indices[i]);
         }
     }
 }
\ No newline at end of file
@@ -2,57 +2,54 @@
 #define _CAMERA_H_
 
 #include <cmath>
+#include <cstdint>
 #include <mutex>
+#include <random>
+#include <string>
 
 #include "imagef.h"
 #include "ray.h"
 #include "vector3d.hpp"
 #include "world.h"
 #include "kd_tree.hpp"
+#include "hash_grid.hpp"
+#include "hit_point_store.h"
+#include "thread_pool.h"
+#include "checkpoint.h"
 #include "sphere.h"
 
 #ifndef M_PI
 #define M_PI 3.141592653587979
 #endif
 
-struct hit_point
+// photon flux for a hit point, recorded by one thread during a pass
+struct photon_deposit
 {
-    vector3df p;
-    vector3df n;
-    vector3df ray_direction; // ray direction
-    std::size_t index = 0; // (optional) index
-    double u, v; // (optional) surface parameters
-    object *obj;
-    int image_x, image_y;
-    vector3df contribution;
-
-    // for PPM
-    double radius2 = 0.0;
-    int photon_count = 0, new_photon_count = 0;
-    vector3df flux = vector3df::zero;
-
-    hit_point(const ray &r, object &obj, const intersect_result &ir)
-        : p(ir.p), n(ir.n), ray_direction(r.direction),
-          index(ir.index), u(ir.u), v(ir.v), obj(&obj),
-          image_x(r.image_x), image_y(r.image_y)
-    {
-
-    }
+    unsigned int index;
+    vector3df flux;
+};
 
-    double get_dim(std::size_t dim)
-    {
-        return p.dim[dim];
-    }
+// deposits of one thread during a pass, bucketed by ranges of hit points so
+// that the ranges can be merged in parallel. Grows with the photon hits of a
+// pass, not with the hit points.
+struct photon_tally
+{
+    std::size_t bucket_size = 1; // hit points per bucket
+    std::vector<std::vector<photon_deposit> > buckets;
 
-    const double &get_dim(std::size_t dim) const
+    void add(unsigned int index, const vector3df &flux)
     {
-        return p.dim[dim];
+        buckets[index / bucket_size].push_back(photon_deposit { index, flux });
     }
+};
 
-    aa_cube get_aabb() const
-    {
-        return aa_cube(p, vector3df::zero);
-    }
+// statistics of a pixel over all SPPM iterations
+struct sppm_pixel
+{
+    double radius2 = 0.0;
+    double photon_count = 0.0;
+    vector3df flux = vector3df::zero; // already modulated by contribution
+    vector3df direct = vector3df::zero; // sum of eye pass colors
 };
 
 class camera
@@ -63,13 +60,27 @@ public:
     double focal_length, aperture;
     std::size_t aperture_samples = 3;
     std::size_t thread_count = 1;
+    std::size_t tile_size = 16; // ray tracing pass, in pixels
+    bool pin_threads = false; // bind pool worker i to CPU i, not the caller
+    bool use_hash_grid = true; // or kd-tree, for hit point lookups
+    bool use_packets = false; // primary rays as packets, main --packets, see --bench-packets
+    std::uint64_t seed = 0; // same seed and thread_count, same image
     double film_width, film_height;
     std::size_t diffuse_depth = 0; // ܷ֮ٴ
 
 private:
-    std::vector<hit_point> _hit_points;
-    kd_tree<hit_point> _kdt;
-    std::mutex _hit_points_lock;
+    hit_point_store _hit_points;
+    kd_tree<hit_position> _kdt; // indexes _hit_points.positions
+    hash_grid _grid;
+    std::size_t _photon_passes = 0;
+    std::vector<photon_tally> _tallies; // per thread, empty between passes
+    std::vector<sppm_pixel> _sppm_pixels;
+    std::size_t _sppm_width = 0, _sppm_iterations = 0;
+    std::uint64_t _sppm_photons = 0; // emitted over all iterations
+    // hit points by pixel, pixel i has _pixel_hit_points[_pixel_begin[i] .. _pixel_begin[i + 1])
+    std::vector<unsigned int> _pixel_begin, _pixel_hit_points;
+    std::mutex _image_lock;
+    thread_pool _pool;
 
 public:
     camera(world &w, const vector3df &location, const vector3df &front, const vector3df &up)
@@ -88,23 +99,51 @@ public:
 
     }
 
-    vector3df ray_trace(const ray &r, const vector3df &contribution);
+    vector3df ray_trace(const ray &r, const vector3df &contribution,
+                        hit_point_store &hit_points);
     void photon_trace(const ray &r, const vector3df &contribution, double radius,
-                      std::size_t depth = 0);
+                      std::default_random_engine &engine,
+                      photon_tally &tally, std::size_t depth = 0);
     void ray_trace_pass(imagef &img);
     double photon_trace_pass(int photon_count, double radius);
     void phong_estimate(imagef &img);
-    void ppm_estimate(imagef &img, int photon_count);
+    void ppm_estimate(imagef &img, std::uint64_t photon_count);
+
+    // Stochastic PPM: every iteration traces one jittered eye ray per pixel
+    // and photon_count photons, only per pixel statistics are kept. Starts
+    // over if the size changes. Returns the largest radius.
+    double sppm_iteration(std::size_t width, std::size_t height, int photon_count,
+                          double initial_radius);
+    // leaves img as it is if it is not of the size of the iterations
+    void sppm_estimate(imagef &img);
+
+    // Binary checkpoint of the PPM state (img from the eye pass, hit points)
+    // or the SPPM state (per pixel statistics) and the progress of the loop,
+    // for the same world (world::fingerprint) and image size. False on I/O
+    // or format errors, or if the checkpoint is not of the sppm mode or
+    // another scene; the camera is unchanged if loading fails.
+    bool save_checkpoint(const std::string &filename, const imagef &img,
+                         const render_progress &progress) const;
+    bool load_checkpoint(const std::string &filename, bool sppm, imagef &img,
+                         render_progress &progress);
 
 private:
+    // the pool, restarted if thread_count or pin_threads changed
+    thread_pool &_threads();
+
+    // ray_trace after the intersection, which may come from a packet
+    vector3df _shade(const ray &r, const world_intersect_result &ir, const vector3df &contribution,
+                     hit_point_store &hit_points);
+    // jitter: one random sample per pixel and aperture, pass picks the numbers
+    void _ray_trace_pass(imagef &img, bool jitter, std::uint64_t pass);
+    // traces photons into the hit points' new_photon_count and flux
+    void _emit_photons(int photon_count, double radius, std::uint64_t pass);
+    // builds _pixel_begin and _pixel_hit_points unless they are up to date
+    void _index_pixels(std::size_t width, std::size_t height);
+
     std::vector<unsigned int> _hit_point_inside(const sphere &r) const;
-    void _hit_point_inside(const sphere &r, kd_tree<hit_point>::node *node,
+    void _hit_point_inside(const sphere &r, std::size_t node,
                            std::vector<unsigned int> &result) const;
-
-    intersect_result _to_intersect_result(const hit_point &hp) const
-    {
-        return intersect_result(hp.p, hp.n, 0.0 /* TODO */, hp.u, hp.v, hp.index);
-    }
 };
 
 #endif // _CAMERA_H_
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "checkpoint.h"
+
+checkpoint_writer::checkpoint_writer(const std::string &filename)
+    : _filename(filename), _temp_filename(filename + ".tmp")
+{
+    _fd = fopen(_temp_filename.c_str(), "wb");
+    _good = _fd != nullptr;
+    write(checkpoint_magic);
+    write(checkpoint_version);
+}
+
+checkpoint_writer::~checkpoint_writer()
+{
+    if (_fd)
+    {
+        fclose(_fd);
+        remove(_temp_filename.c_str());
+    }
+}
+
+void checkpoint_writer::write(const void *data, std::size_t size)
+{
+    if (!_good || size == 0)
+    {
+        return;
+    }
+    _good = fwrite(data, 1, size, _fd) == size;
+    _bytes += size;
+}
+
+bool checkpoint_writer::close()
+{
+    if (!_fd)
+    {
+        return false;
+    }
+    _good = fclose(_fd) == 0 && _good;
+    _fd = nullptr;
+    if (!_good)
+    {
+        remove(_temp_filename.c_str());
+        return false;
+    }
+    if (rename(_temp_filename.c_str(), _filename.c_str()) != 0)
+    {
+        // Windows does not replace an existing file
+        remove(_filename.c_str());
+        _good = rename(_temp_filename.c_str(), _filename.c_str()) == 0;
+    }
+    return _good;
+}
+
+checkpoint_reader::checkpoint_reader(const std::string &filename)
+{
+    _fd = fopen(filename.c_str(), "rb");
+    _good = _fd != nullptr;
+    std::uint32_t magic = 0, version = 0;
+    read(magic);
+    read(version);
+    _good = _good && magic == checkpoint_magic && version == checkpoint_version;
+}
+
+checkpoint_reader::~checkpoint_reader()
+{
+    if (_fd)
+    {
+        fclose(_fd);
+    }
+}
+
+void checkpoint_reader::read(void *data, std::size_t size)
+{
+    if (!_good || size == 0)
+    {
+        return;
+    }
+    _good = fread(data, 1, size, _fd) == size;
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+const std::uint32_t checkpoint_magic = 0x4b435452; // "RTCK"
+const std::uint32_t checkpoint_version = 2;
+
+// loop state of main, saved along with the camera's
+struct render_progress
+{
+    std::uint64_t iteration = 0; // finished iterations
+    std::uint64_t photon_count = 0; // emitted so far
+    double radius = 0.0;
+    std::uint64_t seed = 0;
+};
+
+// Binary checkpoint files: a magic number and version, then raw values in
+// the machine's byte order. Only meant to be read back by the same build.
+class checkpoint_writer
+{
+private:
+    std::string _filename, _temp_filename;
+    FILE *_fd = nullptr;
+    bool _good = false;
+    std::size_t _bytes = 0;
+
+public:
+    // writes to filename.tmp, close() renames it, so a crash while writing
+    // keeps the previous checkpoint
+    explicit checkpoint_writer(const std::string &filename);
+    ~checkpoint_writer();
+
+    void write(const void *data, std::size_t size);
+
+    template <typename T>
+    void write(const T &value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    template <typename T>
+    void write_vector(const std::vector<T> &v)
+    {
+        write((std::uint64_t)v.size());
+        write(v.data(), v.size() * sizeof(T));
+    }
+
+    bool close();
+
+    std::size_t bytes() const
+    {
+        return _bytes;
+    }
+};
+
+class checkpoint_reader
+{
+private:
+    FILE *_fd = nullptr;
+    bool _good = false;
+
+public:
+    explicit checkpoint_reader(const std::string &filename);
+    ~checkpoint_reader();
+
+    bool good() const
+    {
+        return _good;
+    }
+
+    void read(void *data, std::size_t size);
+
+    template <typename T>
+    void read(T &value)
+    {
+        read(&value, sizeof(T));
+    }
+
+    // max_size guards against a corrupt size
+    template <typename T>
+    void read_vector(std::vector<T> &v, std::size_t max_size)
+    {
+        std::uint64_t size = 0;
+        read(size);
+        if (!_good || size > max_size)
+        {
+            _good = false;
+            return;
+        }
+        v.resize(size);
+        read(v.data(), size * sizeof(T));
+    }
+};
+
+#endif // _CHECKPOINT_H_
\ No newline at end of file
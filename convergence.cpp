@@ -0,0 +1,41 @@
+#include "convergence.h"
+
+#include <cmath>
+
+double convergence_monitor::update(const imagef &img)
+{
+    if (_previous.size() != img.raw.size())
+    {
+        _previous = img.raw;
+        _change = -1.0;
+        _below = 0;
+        return _change;
+    }
+
+    double difference = 0.0, total = 0.0;
+    for (std::size_t i = 0; i < img.raw.size(); ++i)
+    {
+        const vector3df &c = img.raw[i], &p = _previous[i];
+        difference += std::fabs(c.x - p.x) + std::fabs(c.y - p.y) + std::fabs(c.z - p.z);
+        total += std::fabs(c.x) + std::fabs(c.y) + std::fabs(c.z);
+    }
+    _previous = img.raw;
+    _change = total > 0.0 ? difference / total : 0.0;
+
+    if (target > 0.0 && _change < target)
+    {
+        ++_below;
+    }
+    else
+    {
+        _below = 0;
+    }
+    return _change;
+}
+
+void convergence_monitor::reset()
+{
+    _previous.clear();
+    _change = -1.0;
+    _below = 0;
+}
\ No newline at end of file
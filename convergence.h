@@ -0,0 +1,41 @@
+#ifndef _CONVERGENCE_H_
+#define _CONVERGENCE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "imagef.h"
+#include "vector3d.hpp"
+
+// Compares successive estimates of a progressive render. The change is
+// sum |current - previous| / sum |current| over all pixels and channels,
+// it falls roughly as 1 / iterations once the estimate is stable.
+class convergence_monitor
+{
+public:
+    double target = 0.0; // converged below this change, 0: never
+    std::size_t patience = 3; // checks in a row below target
+
+private:
+    std::vector<vector3df> _previous;
+    double _change = -1.0;
+    std::size_t _below = 0;
+
+public:
+    // returns the change, or -1 for the first estimate
+    double update(const imagef &img);
+
+    double change() const
+    {
+        return _change;
+    }
+
+    bool converged() const
+    {
+        return target > 0.0 && _below >= patience;
+    }
+
+    void reset();
+};
+
+#endif // _CONVERGENCE_H_
\ No newline at end of file
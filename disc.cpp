@@ -3,6 +3,7 @@
 
 #include "disc.h"
 
+#include "aa_cube.h"
 #include "object.h"
 #include "plane.h"
 #include "ray.h"
@@ -22,4 +23,16 @@ intersect_result disc::intersect(const ray &r) const
     }
 
     return ir;
+}
+
+aa_cube disc::get_aabb() const
+{
+    // extent of a circle on each axis is r * sqrt(1 - n_i^2)
+    vector3df half_size;
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        double n2 = n.dim[dim] * n.dim[dim] / n.length2();
+        half_size.dim[dim] = r * sqrt(n2 < 1.0 ? 1.0 - n2 : 0.0);
+    }
+    return aa_cube(p - half_size, half_size * 2.0);
 }
\ No newline at end of file
@@ -19,6 +19,13 @@ public:
     }
 
     intersect_result intersect(const ray &r) const override;
+
+    bool bounded() const override
+    {
+        return true;
+    }
+
+    aa_cube get_aabb() const override;
 };
 
 #endif // _DISC_H_
\ No newline at end of file
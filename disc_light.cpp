@@ -9,26 +9,11 @@ light_info disc_light::illuminate(const vector3df &p) const
     double distance = direction.length(); // save length
     direction = direction / distance; // normalize
 
-    std::vector<world_intersect_result> results = w.intersect_all(ray(p, direction, 0, 0));
-    vector3df coeff = vector3df::one;
-    for (auto &ir : results)
+    // stop short of the light itself
+    vector3df coeff;
+    if (!w.transmittance(ray(p, direction, 0, 0), distance - eps, coeff))
     {
-        if (ir.result.distance >= distance)
-        {
-            continue;
-        }
-        double distance_light2 = (ir.result.p - c).length2();
-        if (distance_light2 < eps2)
-        {
-            continue;
-        }
-
-        if (ir.obj.refractiveness.length2() <= eps2)
-        {
-            return light_info::dark;
-        }
-
-        coeff = coeff.modulate(ir.obj.refractiveness);
+        return light_info::dark;
     }
     return light_info(color.modulate(coeff), -direction);
 }
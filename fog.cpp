@@ -3,7 +3,7 @@
 #include <cmath>
 #include <random>
 
-static std::default_random_engine engine;
+#include "rng.h"
 
 intersect_result fog::intersect(const ray &r) const
 {
@@ -13,6 +13,9 @@ intersect_result fog::intersect(const ray &r) const
         return intersect_result::failed;
     }
 
+    // seeded by the ray, no state shared between threads
+    std::default_random_engine engine(ray_seed(r, seed));
+
     std::uniform_real_distribution<> dist(0.0, 1.0);
     if (dist(engine) < 0.8)
     {
@@ -1,8 +1,11 @@
 #ifndef _FOG_H_
 #define _FOG_H_
 
+#include <cstdint>
+
 #include "object.h"
 #include "sphere.h"
+#include "aa_cube.h"
 #include "ray.h"
 #include "vector3d.hpp"
 
@@ -11,6 +14,7 @@ class fog
 {
 public:
     sphere &boundary;
+    std::uint64_t seed = 0;
 
     fog(sphere &boundary)
         : object(), boundary(boundary)
@@ -19,6 +23,16 @@ public:
     }
 
     intersect_result intersect(const ray &r) const override;
+
+    bool bounded() const override
+    {
+        return true;
+    }
+
+    aa_cube get_aabb() const override
+    {
+        return boundary.get_aabb();
+    }
 };
 
 
@@ -0,0 +1,137 @@
+#ifndef _HASH_GRID_HPP_
+#define _HASH_GRID_HPP_
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+#include "vector3d.hpp"
+
+// Uniform grid for fixed-radius queries, cells are hashed into buckets.
+// Every point is in exactly one cell, so queries need no deduplication.
+class hash_grid
+{
+public:
+    double radius = 0.0; // largest query radius supported
+    double cell_size = 0.0;
+
+private:
+    std::vector<unsigned int> _bucket_begin; // bucket i is [begin[i], begin[i + 1])
+    std::vector<unsigned int> _entries; // index of points, grouped by bucket
+    std::uint64_t _mask = 0;
+
+public:
+    bool empty() const
+    {
+        return _entries.empty();
+    }
+
+    // T should have T::get_dim(i), i = 0, 1, 2
+    template <typename T>
+    void build(const std::vector<T> &points, double radius);
+
+    // Calls f(i) for every point i whose cell is within r of c, r <= radius.
+    // Points farther than r may be included, filter them by distance.
+    template <typename TFUNC>
+    void query(const vector3df &c, double r, TFUNC f) const;
+
+private:
+    std::ptrdiff_t _cell(double x) const
+    {
+        return (std::ptrdiff_t)std::floor(x / cell_size);
+    }
+
+    std::size_t _bucket(std::ptrdiff_t x, std::ptrdiff_t y, std::ptrdiff_t z) const
+    {
+        return (((std::uint64_t)x * 73856093u) ^
+                ((std::uint64_t)y * 19349663u) ^
+                ((std::uint64_t)z * 83492791u)) & _mask;
+    }
+};
+
+template <typename T>
+void hash_grid::build(const std::vector<T> &points, double radius)
+{
+    this->radius = radius;
+    cell_size = 2.0 * radius; // a query touches at most 2 x 2 x 2 cells
+
+    std::size_t bucket_count = 1;
+    while (bucket_count < points.size())
+    {
+        bucket_count <<= 1;
+    }
+    _mask = bucket_count - 1;
+
+    // counting sort by bucket
+    std::vector<unsigned int> buckets(points.size());
+    _bucket_begin.assign(bucket_count + 1, 0);
+    for (std::size_t i = 0; i < points.size(); ++i)
+    {
+        const T &p = points[i];
+        buckets[i] = _bucket(_cell(p.get_dim(0)), _cell(p.get_dim(1)), _cell(p.get_dim(2)));
+        ++_bucket_begin[buckets[i] + 1];
+    }
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+        _bucket_begin[i + 1] += _bucket_begin[i];
+    }
+
+    std::vector<unsigned int> next(_bucket_begin.begin(), _bucket_begin.end() - 1);
+    _entries.resize(points.size());
+    for (std::size_t i = 0; i < points.size(); ++i)
+    {
+        _entries[next[buckets[i]]++] = i;
+    }
+}
+
+template <typename TFUNC>
+void hash_grid::query(const vector3df &c, double r, TFUNC f) const
+{
+    if (empty())
+    {
+        return;
+    }
+
+    const std::ptrdiff_t x0 = _cell(c.x - r), x1 = _cell(c.x + r),
+                         y0 = _cell(c.y - r), y1 = _cell(c.y + r),
+                         z0 = _cell(c.z - r), z1 = _cell(c.z + r);
+
+    // Different cells may share a bucket, visit each bucket once. Usually
+    // 2 x 2 x 2 cells, rounding may add one more per axis.
+    std::size_t visited[27];
+    std::size_t visited_count = 0;
+    for (std::ptrdiff_t z = z0; z <= z1; ++z)
+    {
+        for (std::ptrdiff_t y = y0; y <= y1; ++y)
+        {
+            for (std::ptrdiff_t x = x0; x <= x1; ++x)
+            {
+                std::size_t b = _bucket(x, y, z);
+                bool is_visited = false;
+                for (std::size_t i = 0; i < visited_count; ++i)
+                {
+                    if (visited[i] == b)
+                    {
+                        is_visited = true;
+                        break;
+                    }
+                }
+                if (is_visited)
+                {
+                    continue;
+                }
+                if (visited_count < 27)
+                {
+                    visited[visited_count++] = b;
+                }
+
+                for (unsigned int i = _bucket_begin[b]; i < _bucket_begin[b + 1]; ++i)
+                {
+                    f(_entries[i]);
+                }
+            }
+        }
+    }
+}
+
+#endif // _HASH_GRID_HPP_
\ No newline at end of file
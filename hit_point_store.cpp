@@ -0,0 +1,50 @@
+#include "hit_point_store.h"
+
+void hit_point_store::clear()
+{
+    positions.clear();
+    radius2.clear();
+    shading.clear();
+    pixels.clear();
+    statistics.clear();
+}
+
+void hit_point_store::reserve(std::size_t size)
+{
+    positions.reserve(size);
+    radius2.reserve(size);
+    shading.reserve(size);
+    pixels.reserve(size);
+    statistics.reserve(size);
+}
+
+void hit_point_store::push_back(const ray &r, object &obj, const intersect_result &ir,
+                                const vector3df &contribution)
+{
+    positions.push_back(hit_position { ir.p });
+    radius2.push_back(0.0);
+    shading.push_back(hit_shading { &obj, ir.n, r.direction, (float)ir.u, (float)ir.v,
+                                    (unsigned int)ir.index });
+    pixels.push_back(hit_pixel { contribution, r.image_x, r.image_y });
+    statistics.push_back(hit_statistics());
+}
+
+void hit_point_store::append(const hit_point_store &other, std::size_t begin, std::size_t end)
+{
+    positions.insert(positions.end(), other.positions.begin() + begin,
+                     other.positions.begin() + end);
+    radius2.insert(radius2.end(), other.radius2.begin() + begin, other.radius2.begin() + end);
+    shading.insert(shading.end(), other.shading.begin() + begin, other.shading.begin() + end);
+    pixels.insert(pixels.end(), other.pixels.begin() + begin, other.pixels.begin() + end);
+    statistics.insert(statistics.end(), other.statistics.begin() + begin,
+                      other.statistics.begin() + end);
+}
+
+std::size_t hit_point_store::memory_usage() const
+{
+    return positions.capacity() * sizeof(hit_position) +
+           radius2.capacity() * sizeof(double) +
+           shading.capacity() * sizeof(hit_shading) +
+           pixels.capacity() * sizeof(hit_pixel) +
+           statistics.capacity() * sizeof(hit_statistics);
+}
\ No newline at end of file
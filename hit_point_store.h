@@ -0,0 +1,91 @@
+#ifndef _HIT_POINT_STORE_H_
+#define _HIT_POINT_STORE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "vector3d.hpp"
+#include "aa_cube.h"
+#include "ray.h"
+#include "object.h"
+
+// position of a hit point, what kd_tree and hash_grid index
+struct hit_position
+{
+    vector3df p;
+
+    const double &get_dim(std::size_t dim) const
+    {
+        return p.dim[dim];
+    }
+
+    aa_cube get_aabb() const
+    {
+        return aa_cube(p, vector3df::zero);
+    }
+};
+
+// what the BRDF and the Phong model need
+struct hit_shading
+{
+    object *obj;
+    vector3ds n;
+    vector3ds ray_direction;
+    float u, v; // (optional) surface parameters
+    unsigned int index; // (optional) index
+};
+
+// where the estimate goes
+struct hit_pixel
+{
+    vector3ds contribution;
+    int image_x, image_y;
+};
+
+// for PPM
+struct hit_statistics
+{
+    vector3df flux = vector3df::zero;
+    int photon_count = 0, new_photon_count = 0;
+};
+
+// Hit points of the eye pass, structure of arrays: a photon only reads
+// positions and radii to find hit points, and the shading data of those it
+// finds. Positions, radii and flux stay double: positions start shadow rays,
+// flux adds up over thousands of passes.
+class hit_point_store
+{
+public:
+    std::vector<hit_position> positions;
+    std::vector<double> radius2; // for PPM
+    std::vector<hit_shading> shading;
+    std::vector<hit_pixel> pixels;
+    std::vector<hit_statistics> statistics;
+
+    std::size_t size() const
+    {
+        return positions.size();
+    }
+
+    bool empty() const
+    {
+        return positions.empty();
+    }
+
+    void clear();
+    void reserve(std::size_t size);
+    void push_back(const ray &r, object &obj, const intersect_result &ir,
+                   const vector3df &contribution);
+    // [begin, end) of other
+    void append(const hit_point_store &other, std::size_t begin, std::size_t end);
+
+    intersect_result to_intersect_result(std::size_t i) const
+    {
+        const hit_shading &s = shading[i];
+        return intersect_result(positions[i].p, s.n, 0.0 /* TODO */, s.u, s.v, s.index);
+    }
+
+    std::size_t memory_usage() const; // in bytes
+};
+
+#endif // _HIT_POINT_STORE_H_
\ No newline at end of file
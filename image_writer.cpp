@@ -0,0 +1,86 @@
+#include "image_writer.h"
+
+#include <chrono>
+#include <cstdio>
+
+image_writer::image_writer(std::size_t width, std::size_t height, const save_function &save)
+    : _save(save)
+{
+    _frames[0].reset(new imagef(width, height));
+    _frames[1].reset(new imagef(width, height));
+    _thread = std::thread(&image_writer::_worker, this);
+}
+
+image_writer::~image_writer()
+{
+    flush();
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _stop = true;
+    }
+    _changed.notify_all();
+    _thread.join();
+}
+
+imagef &image_writer::back()
+{
+    // never being saved, submit() only hands over a frame once the other is done
+    return *_frames[_back];
+}
+
+void image_writer::submit(const std::string &filename)
+{
+    auto begin_time = std::chrono::steady_clock::now();
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _changed.wait(lock, [this] { return !_queued && !_writing; });
+        _filename = filename;
+        _back = 1 - _back;
+        _queued = true;
+    }
+    _changed.notify_all();
+    _wait_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                   begin_time).count();
+}
+
+void image_writer::flush()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _changed.wait(lock, [this] { return !_queued && !_writing; });
+}
+
+void image_writer::_worker()
+{
+    for (;;)
+    {
+        std::string filename;
+        const imagef *frame;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _changed.wait(lock, [this] { return _stop || _queued; });
+            if (_queued)
+            {
+                _queued = false;
+                _writing = true;
+                filename = _filename;
+                frame = _frames[1 - _back].get();
+            }
+            else // stopped
+            {
+                return;
+            }
+        }
+
+        auto begin_time = std::chrono::steady_clock::now();
+        _save(*frame, filename);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                       begin_time).count();
+        printf("Saved %s in %.3lf s\n", filename.c_str(), seconds);
+
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _writing = false;
+        }
+        _changed.notify_all();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef _IMAGE_WRITER_H_
+#define _IMAGE_WRITER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "imagef.h"
+
+// Saves images on a background thread. Two frames: the caller fills the
+// back one while the other is being saved, then submits it. Only submit()
+// may wait, if the previous frame is still being saved.
+class image_writer
+{
+public:
+    typedef std::function<void(const imagef &, const std::string &)> save_function;
+
+private:
+    save_function _save;
+    std::unique_ptr<imagef> _frames[2];
+    std::size_t _back = 0;
+    bool _queued = false; // frame 1 - _back waits for the thread
+    bool _writing = false; // frame 1 - _back is being saved
+    bool _stop = false;
+    std::string _filename;
+    double _wait_seconds = 0.0; // spent by the caller in submit()
+    std::mutex _lock;
+    std::condition_variable _changed;
+    std::thread _thread;
+
+public:
+    image_writer(std::size_t width, std::size_t height, const save_function &save);
+    ~image_writer(); // saves what has been submitted
+
+    image_writer(const image_writer &) = delete;
+    image_writer &operator=(const image_writer &) = delete;
+
+    // the frame to fill
+    imagef &back();
+
+    // saves the back frame as filename, the caller gets the other one
+    void submit(const std::string &filename);
+
+    // waits until everything submitted is saved
+    void flush();
+
+    double wait_seconds() const
+    {
+        return _wait_seconds;
+    }
+
+private:
+    void _worker();
+};
+
+#endif // _IMAGE_WRITER_H_
\ No newline at end of file
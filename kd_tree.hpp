@@ -5,14 +5,19 @@
 #include <vector>
 #include <iterator>
 #include <algorithm>
+#include <cmath>
+#include <thread>
 
 #include "aa_cube.h"
 
-// T should have T::get_dim(i), i = 0, 1, 2
+// T should have T::get_dim(i), i = 0, 1, 2, and T::get_aabb(). build_sah
+// also needs T::get_clipped_aabb(box, aabb), the bounds of the part of the
+// point inside box, false if there is none.
 template <typename T>
 class kd_tree
 {
 public:
+    // only used while building, see flat_node
     class node
     {
     public:
@@ -20,6 +25,7 @@ public:
         node *left = nullptr, *right = nullptr;
         unsigned int *points = nullptr; // just stores index
         unsigned int split_dim, size = 0;
+        double split = 0.0; // split plane of split_dim, valid if not leaf
 
         node(const aa_cube &range, std::size_t split_dim)
             : range(range), split_dim(split_dim)
@@ -44,45 +50,262 @@ public:
         }
     };
 
-    std::shared_ptr<node> root = nullptr;
-    std::vector<T> points;
+    static constexpr std::size_t max_depth = 30;
+    static constexpr std::size_t parallel_size = 4096; // smallest node built in parallel
+
+    // 16 bytes, the left child of an interior node is the next one
+    struct flat_node
+    {
+        double split; // split plane, interior only
+        unsigned int index; // interior: right child, leaf: first entry in indices
+        unsigned int info; // split_dim, or 3 for a leaf, in the low 2 bits; leaf size above
+
+        bool is_leaf() const
+        {
+            return (info & 3) == 3;
+        }
+
+        unsigned int split_dim() const
+        {
+            return info & 3;
+        }
+
+        unsigned int size() const
+        {
+            return info >> 2;
+        }
+    };
+
+    aa_cube range = aa_cube(vector3df::zero, vector3df::zero); // bounding box of all points
+    std::vector<flat_node> nodes; // nodes[0] is the root
+    std::vector<unsigned int> indices; // leaf contents, index of points
+    std::vector<T> points; // empty if built in place
 
     kd_tree()
     {
 
     }
 
-    kd_tree(std::shared_ptr<node> root, std::vector<T> &&points)
-        : root(root), points(std::move(points))
+    explicit kd_tree(std::shared_ptr<node> root)
+        : range(root->range)
+    {
+        _flatten(root.get(), nodes, indices);
+    }
+
+    bool empty() const
+    {
+        return nodes.empty();
+    }
+
+    // Orders the children of interior node i along r and clips [t_min, t_max]
+    // at the split plane. Returns 1 if only first has to be visited (with the
+    // whole interval), or 2 if first covers [t_min, t_split] and second
+    // covers [t_split, t_max].
+    std::size_t clip_children(std::size_t i, const ray &r, double t_min, double t_max,
+                              std::size_t &first, std::size_t &second, double &t_split) const
+    {
+        const flat_node &n = nodes[i];
+        const std::size_t dim = n.split_dim();
+        const double o = r.origin.dim[dim], d = r.direction.dim[dim];
+        const bool left_first = o < n.split || (o == n.split && d <= 0.0);
+        first = left_first ? i + 1 : n.index;
+        second = left_first ? n.index : i + 1;
+        if (d == 0.0)
+        {
+            return 1;
+        }
+
+        t_split = (n.split - o) / d;
+        if (t_split > t_max || t_split < 0.0)
+        {
+            return 1;
+        }
+        else if (t_split < t_min)
+        {
+            first = second;
+            return 1;
+        }
+        return 2;
+    }
+
+    // clip_children for the rays of rp in mask. The children are ordered along
+    // the first of them, every ray in that order is passed to the children it
+    // goes through with its part of the interval. Returns the rays that go
+    // the other way round, which are in neither mask.
+    ray_packet::mask_t clip_children(std::size_t i, const ray_packet &rp, ray_packet::mask_t mask,
+                                     const ray_packet::interval &interval,
+                                     std::size_t &first, ray_packet::mask_t &first_mask,
+                                     ray_packet::interval &first_interval,
+                                     std::size_t &second, ray_packet::mask_t &second_mask,
+                                     ray_packet::interval &second_interval) const
     {
+        const flat_node &n = nodes[i];
+        const std::size_t dim = n.split_dim();
+        const double *o = rp.origin[dim], *d = rp.direction[dim];
+        const std::size_t k0 = ray_packet::lowest(mask);
+        const bool left_first = o[k0] < n.split || (o[k0] == n.split && d[k0] <= 0.0);
+        first = left_first ? i + 1 : n.index;
+        second = left_first ? n.index : i + 1;
 
+        first_mask = second_mask = 0;
+        ray_packet::mask_t reversed = 0;
+        for (ray_packet::mask_t m = mask; m; m &= m - 1)
+        {
+            const std::size_t k = ray_packet::lowest(m);
+            const ray_packet::mask_t bit = (ray_packet::mask_t)1 << k;
+            if ((o[k] < n.split || (o[k] == n.split && d[k] <= 0.0)) != left_first)
+            {
+                reversed |= bit;
+                continue;
+            }
+
+            // as for a single ray
+            const double t_min = interval.t_min[k], t_max = interval.t_max[k];
+            if (d[k] != 0.0)
+            {
+                const double t_split = (n.split - o[k]) / d[k];
+                if (t_split <= t_max && t_split >= 0.0)
+                {
+                    second_mask |= bit;
+                    second_interval.t_max[k] = t_max;
+                    if (t_split < t_min)
+                    {
+                        second_interval.t_min[k] = t_min;
+                        continue;
+                    }
+                    second_interval.t_min[k] = t_split;
+                    first_mask |= bit;
+                    first_interval.t_min[k] = t_min;
+                    first_interval.t_max[k] = t_split;
+                    continue;
+                }
+            }
+            first_mask |= bit;
+            first_interval.t_min[k] = t_min;
+            first_interval.t_max[k] = t_max;
+        }
+        return reversed;
     }
 
+    // cost constants of the Surface Area Heuristic
+    struct sah_params
+    {
+        double traversal_cost = 1.0, intersection_cost = 1.5;
+        std::size_t bins = 32; // candidate planes per axis
+        // 0 for 8 + 1.3 log2(N) as in pbrt, never more than max_depth
+        std::size_t depth_limit = 0;
+    };
+
+    struct statistics
+    {
+        std::size_t node_count = 0, leaf_count = 0, empty_leaf_count = 0;
+        std::size_t depth = 0, max_leaf_size = 0, leaf_points = 0; // with duplicates
+        double average_leaf_size = 0.0;
+        double sah_cost = 0.0; // expected cost of a random ray hitting the root
+    };
+
+    // Both builders produce the same tree for any thread_count.
+    template <typename TITERATOR>
+    static kd_tree build(TITERATOR begin, TITERATOR end, bool use_median,
+                         std::size_t thread_count = 1);
+
+    // Indexes points where they are, without a copy. indices refer to
+    // points, which has to outlive the tree.
+    static kd_tree build_in_place(const std::vector<T> &points, bool use_median,
+                                  std::size_t thread_count = 1);
+
+    // binned SAH, chooses the axis and the plane of every split by cost
     template <typename TITERATOR>
-    static kd_tree build(TITERATOR begin, TITERATOR end, bool use_median);
+    static kd_tree build_sah(TITERATOR begin, TITERATOR end,
+                             const sah_params &params = sah_params(),
+                             std::size_t thread_count = 1);
+
+    statistics get_statistics(const sah_params &params = sah_params()) const;
 
 private:
+    static std::shared_ptr<node> _make_root(const std::vector<T> &points);
     static void _fill_node(node *n, const std::vector<T> &points, std::size_t depth,
-                           bool use_median);
+                           bool use_median, std::size_t thread_count);
+    static void _fill_node_sah(node *n, const std::vector<T> &points, std::size_t depth,
+                               const sah_params &params, std::size_t thread_count);
+    static void _split(node *n, const std::vector<T> &points, double split,
+                       std::size_t next_dim, std::size_t thread_count,
+                       const std::vector<aa_cube> *bounds = nullptr);
+    template <typename TTASK>
+    static void _parallel_for(std::size_t size, std::size_t thread_count, TTASK task);
+    template <typename TTASK>
+    static void _fill_children(node *n, std::size_t thread_count, TTASK fill);
+    static void _flatten(const node *n, std::vector<flat_node> &nodes,
+                         std::vector<unsigned int> &indices);
+    void _get_statistics(std::size_t i, const aa_cube &range, std::size_t depth,
+                         double root_area, const sah_params &params,
+                         statistics &result) const;
 };
 
+template <typename T>
+constexpr std::size_t kd_tree<T>::max_depth;
+
+template <typename T>
+constexpr std::size_t kd_tree<T>::parallel_size;
+
 template <typename T>
 template <typename TITERATOR>
-kd_tree<T> kd_tree<T>::build(TITERATOR begin, TITERATOR end, bool use_median)
+kd_tree<T> kd_tree<T>::build(TITERATOR begin, TITERATOR end, bool use_median,
+                             std::size_t thread_count)
+{
+    std::vector<T> points(begin, end);
+    kd_tree result = build_in_place(points, use_median, thread_count);
+    result.points = std::move(points);
+    return result;
+}
+
+template <typename T>
+kd_tree<T> kd_tree<T>::build_in_place(const std::vector<T> &points, bool use_median,
+                                      std::size_t thread_count)
+{
+    std::shared_ptr<node> root = _make_root(points);
+    _fill_node(root.get(), points, 0, use_median, std::max<std::size_t>(thread_count, 1));
+
+    return kd_tree(root);
+}
+
+template <typename T>
+template <typename TITERATOR>
+kd_tree<T> kd_tree<T>::build_sah(TITERATOR begin, TITERATOR end, const sah_params &params,
+                                 std::size_t thread_count)
+{
+    std::vector<T> points(begin, end);
+    std::shared_ptr<node> root = _make_root(points);
+    sah_params limited = params;
+    if (limited.depth_limit == 0)
+    {
+        const double count = std::max<double>(points.size(), 1.0);
+        limited.depth_limit = 8 + (std::size_t)(1.3 * std::log2(count));
+    }
+    limited.depth_limit = std::min(limited.depth_limit, max_depth);
+    _fill_node_sah(root.get(), points, 0, limited, std::max<std::size_t>(thread_count, 1));
+
+    kd_tree result(root);
+    result.points = std::move(points);
+    return result;
+}
+
+template <typename T>
+std::shared_ptr<typename kd_tree<T>::node>
+kd_tree<T>::_make_root(const std::vector<T> &points)
 {
     // find axis-aligned bounding box
-    std::vector<T> points;
-    std::vector<unsigned int> numbers;
-    aa_cube begin_aabb = begin->get_aabb();
-    vector3df min_v(begin_aabb.p);
-    vector3df max_v(begin_aabb.p + begin_aabb.size);
-    for (TITERATOR iter = begin; iter != end; ++iter)
-    {
-        const T &point = *iter;
+    vector3df min_v = vector3df::zero, max_v = vector3df::zero;
+    if (!points.empty())
+    {
+        aa_cube first_aabb = points[0].get_aabb();
+        min_v = first_aabb.p;
+        max_v = first_aabb.p + first_aabb.size;
+    }
+    for (const T &point : points)
+    {
         aa_cube aabb = point.get_aabb();
         vector3df p2 = aabb.p + aabb.size;
-        numbers.push_back(points.size());
-        points.push_back(point);
         for (std::size_t dim = 0; dim < 3; ++dim)
         {
             if (aabb.p.dim[dim] < min_v.dim[dim])
@@ -100,21 +323,23 @@ kd_tree<T> kd_tree<T>::build(TITERATOR begin, TITERATOR end, bool use_median)
     std::shared_ptr<node> root = std::make_shared<node>(
         aa_cube(min_v, max_v - min_v), 0
     );
-    root->size = numbers.size();
+    root->size = points.size();
     root->points = new unsigned int[root->size];
-    std::copy(numbers.begin(), numbers.end(), root->points);
-    _fill_node(root.get(), points, 0, use_median);
-
-    return kd_tree(root, std::move(points));
+    for (std::size_t i = 0; i < root->size; ++i)
+    {
+        root->points[i] = i;
+    }
+    return root;
 }
 
 template <typename T>
 void kd_tree<T>::_fill_node(typename kd_tree<T>::node *n,
                             const std::vector<T> &points,
                             std::size_t depth,
-                            bool use_median)
+                            bool use_median,
+                            std::size_t thread_count)
 {
-    if (depth >= 30) // too deep
+    if (depth >= max_depth) // too deep
     {
         return;
     }
@@ -143,19 +368,6 @@ void kd_tree<T>::_fill_node(typename kd_tree<T>::node *n,
         split = n->range.p.dim[n->split_dim] + n->range.size.dim[n->split_dim] / 2.0;
     }
 
-    vector3df delta(0.0, 0.0, 0.0);
-    delta.dim[n->split_dim] = split - n->range.p.dim[n->split_dim];
-    vector3df size_proj = n->range.size;
-    size_proj.dim[n->split_dim] = 0.0;
-    aa_cube left_cube(n->range.p - vector3df::one * eps,
-                      size_proj + delta + vector3df::one * (2.0 * eps)),
-            right_cube(n->range.p + delta - vector3df::one * eps,
-                       n->range.size - delta + vector3df::one * (2.0 * eps));
-
-    std::vector<unsigned int> left_points, right_points;
-    left_points.reserve(n->size);
-    right_points.reserve(n->size);
-
     std::size_t next_dim;
     if (n->split_dim == 0)
     {
@@ -175,24 +387,229 @@ void kd_tree<T>::_fill_node(typename kd_tree<T>::node *n,
         return;
     }
 
-    n->left = new typename kd_tree<T>::node(left_cube, next_dim),
-    n->right = new typename kd_tree<T>::node(right_cube, next_dim);
+    _split(n, points, split, next_dim, thread_count);
+
+    _fill_children(n, thread_count,
+                   [n, &points, depth, use_median] (node *child, std::size_t child_threads)
+                   {
+                       if (child->size < n->size)
+                       {
+                           _fill_node(child, points, depth + 1, use_median, child_threads);
+                       }
+                   });
+}
+
+template <typename T>
+void kd_tree<T>::_fill_node_sah(typename kd_tree<T>::node *n,
+                                const std::vector<T> &points,
+                                std::size_t depth,
+                                const sah_params &params,
+                                std::size_t thread_count)
+{
+    if (depth >= params.depth_limit) // too deep
+    {
+        return;
+    }
+
+    if (n->size < 2)
+    {
+        return;
+    }
 
+    double area = n->range.surface_area();
+    if (area <= 0.0)
+    {
+        return;
+    }
+
+    // The boxes of the points clipped to this node, so that a point only
+    // counts (and goes) where it really is. Points that only touch the node
+    // through the parent's box are dropped.
+    std::vector<aa_cube> bounds(n->size, n->range);
+    std::vector<unsigned char> inside(n->size);
+    std::size_t chunk_count = n->size >= parallel_size ? thread_count : 1;
+    _parallel_for(n->size, chunk_count,
+                  [n, &points, &bounds, &inside] (std::size_t begin, std::size_t end,
+                                                  std::size_t)
+                  {
+                      for (std::size_t i = begin; i < end; ++i)
+                      {
+                          inside[i] = points[n->points[i]].get_clipped_aabb(n->range, bounds[i]);
+                      }
+                  });
+    std::size_t inside_count = 0;
     for (std::size_t i = 0; i < n->size; ++i)
     {
-        const T &p = points[n->points[i]];
-        aa_cube aabb = p.get_aabb();
-        vector3df p2 = aabb.p + aabb.size;
-        if (aabb.p.dim[n->split_dim] < split + eps)
+        if (inside[i])
         {
-            left_points.push_back(n->points[i]);
+            n->points[inside_count] = n->points[i];
+            bounds[inside_count] = bounds[i];
+            ++inside_count;
         }
-        if (p2.dim[n->split_dim] >= split - eps)
+    }
+    n->size = inside_count;
+    bounds.erase(bounds.begin() + inside_count, bounds.end());
+    if (n->size < 2)
+    {
+        return;
+    }
+
+    // Count, per bin, the boxes starting and ending in it. A plane between
+    // bins i - 1 and i has on its left the boxes starting before it, and on
+    // its right the boxes ending after it.
+    const std::size_t bins = params.bins;
+    std::vector<unsigned int> counts(6 * bins); // min and max counts of each axis
+    chunk_count = n->size >= parallel_size ? thread_count : 1;
+    std::vector<std::vector<unsigned int> > chunk_counts(chunk_count);
+    _parallel_for(n->size, chunk_count,
+                  [n, &bounds, &chunk_counts, bins] (std::size_t begin, std::size_t end,
+                                                     std::size_t chunk)
+                  {
+                      std::vector<unsigned int> &count = chunk_counts[chunk];
+                      count.resize(6 * bins);
+                      for (std::size_t i = begin; i < end; ++i)
+                      {
+                          const aa_cube &aabb = bounds[i];
+                          for (std::size_t dim = 0; dim < 3; ++dim)
+                          {
+                              const double lo = n->range.p.dim[dim],
+                                           extent = n->range.size.dim[dim];
+                              if (extent <= eps)
+                              {
+                                  continue;
+                              }
+                              auto to_bin = [lo, extent, bins] (double x) -> std::size_t
+                              {
+                                  double b = (x - lo) / extent * bins;
+                                  if (b <= 0.0)
+                                  {
+                                      return 0;
+                                  }
+                                  return std::min((std::size_t)b, bins - 1);
+                              };
+                              ++count[(2 * dim) * bins + to_bin(aabb.p.dim[dim])];
+                              ++count[(2 * dim + 1) * bins +
+                                      to_bin(aabb.p.dim[dim] + aabb.size.dim[dim])];
+                          }
+                      }
+                  });
+    for (const auto &count : chunk_counts)
+    {
+        for (std::size_t i = 0; i < counts.size(); ++i)
         {
-            right_points.push_back(n->points[i]);
+            counts[i] += count[i];
         }
     }
 
+    double best_cost = params.intersection_cost * n->size; // cost as a leaf
+    std::size_t best_dim = 3;
+    double best_split = 0.0;
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        const double lo = n->range.p.dim[dim], extent = n->range.size.dim[dim];
+        if (extent <= eps)
+        {
+            continue;
+        }
+
+        const unsigned int *min_count = &counts[(2 * dim) * bins],
+                           *max_count = &counts[(2 * dim + 1) * bins];
+        // the children only differ from the node along dim
+        const double a = n->range.size.dim[(dim + 1) % 3], b = n->range.size.dim[(dim + 2) % 3];
+        std::size_t left_count = 0, right_count = n->size;
+        for (std::size_t i = 1; i < bins; ++i)
+        {
+            left_count += min_count[i - 1];
+            right_count -= max_count[i - 1];
+
+            double left_extent = extent * i / bins;
+            double left_area = 2.0 * (a * b + (a + b) * left_extent);
+            double right_area = 2.0 * (a * b + (a + b) * (extent - left_extent));
+
+            double cost = params.traversal_cost +
+                          params.intersection_cost * (left_area * left_count +
+                                                      right_area * right_count) / area;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_dim = dim;
+                best_split = lo + left_extent;
+            }
+        }
+    }
+
+    if (best_dim == 3) // a leaf is cheaper
+    {
+        return;
+    }
+
+    n->split_dim = best_dim;
+    _split(n, points, best_split, best_dim, thread_count, &bounds);
+
+    _fill_children(n, thread_count,
+                   [&points, depth, &params] (node *child, std::size_t child_threads)
+                   {
+                       _fill_node_sah(child, points, depth + 1, params, child_threads);
+                   });
+}
+
+template <typename T>
+void kd_tree<T>::_split(typename kd_tree<T>::node *n,
+                        const std::vector<T> &points,
+                        double split,
+                        std::size_t next_dim,
+                        std::size_t thread_count,
+                        const std::vector<aa_cube> *bounds)
+{
+    vector3df delta(0.0, 0.0, 0.0);
+    delta.dim[n->split_dim] = split - n->range.p.dim[n->split_dim];
+    vector3df size_proj = n->range.size;
+    size_proj.dim[n->split_dim] = 0.0;
+    aa_cube left_cube(n->range.p - vector3df::one * eps,
+                      size_proj + delta + vector3df::one * (2.0 * eps)),
+            right_cube(n->range.p + delta - vector3df::one * eps,
+                       n->range.size - delta + vector3df::one * (2.0 * eps));
+
+    n->split = split;
+    n->left = new typename kd_tree<T>::node(left_cube, next_dim),
+    n->right = new typename kd_tree<T>::node(right_cube, next_dim);
+
+    // partition chunks separately and concatenate them in order
+    std::size_t chunk_count = n->size >= parallel_size ? thread_count : 1;
+    std::vector<std::vector<unsigned int> > left_chunks(chunk_count), right_chunks(chunk_count);
+    _parallel_for(n->size, chunk_count,
+                  [n, &points, split, bounds, &left_chunks, &right_chunks] (std::size_t begin,
+                                                                            std::size_t end,
+                                                                            std::size_t chunk)
+                  {
+                      std::vector<unsigned int> &left_points = left_chunks[chunk],
+                                                &right_points = right_chunks[chunk];
+                      left_points.reserve(end - begin);
+                      right_points.reserve(end - begin);
+                      for (std::size_t i = begin; i < end; ++i)
+                      {
+                          aa_cube aabb = bounds ? (*bounds)[i] : points[n->points[i]].get_aabb();
+                          vector3df p2 = aabb.p + aabb.size;
+                          if (aabb.p.dim[n->split_dim] < split + eps)
+                          {
+                              left_points.push_back(n->points[i]);
+                          }
+                          if (p2.dim[n->split_dim] >= split - eps)
+                          {
+                              right_points.push_back(n->points[i]);
+                          }
+                      }
+                  });
+
+    std::vector<unsigned int> left_points, right_points;
+    left_points.reserve(n->size);
+    right_points.reserve(n->size);
+    for (std::size_t i = 0; i < chunk_count; ++i)
+    {
+        left_points.insert(left_points.end(), left_chunks[i].begin(), left_chunks[i].end());
+        right_points.insert(right_points.end(), right_chunks[i].begin(), right_chunks[i].end());
+    }
+
     n->left->size = left_points.size();
     n->left->points = new unsigned int[n->left->size];
     std::copy(left_points.begin(), left_points.end(), n->left->points);
@@ -201,15 +618,135 @@ void kd_tree<T>::_fill_node(typename kd_tree<T>::node *n,
     n->right->points = new unsigned int[n->right->size];
     std::copy(right_points.begin(), right_points.end(), n->right->points);
 
-    if (n->left->size < n->size)
+    // only leaves keep their points
+    delete [] n->points;
+    n->points = nullptr;
+}
+
+template <typename T>
+template <typename TTASK>
+void kd_tree<T>::_parallel_for(std::size_t size, std::size_t thread_count, TTASK task)
+{
+    if (thread_count <= 1)
     {
-        _fill_node(n->left, points, depth + 1, use_median);
+        task(0, size, 0);
+        return;
     }
 
-    if (n->right->size < n->size)
+    std::vector<std::shared_ptr<std::thread> > tasks;
+    std::size_t chunk_size = size / thread_count;
+    for (std::size_t i = 0; i < thread_count - 1; ++i)
+    {
+        tasks.push_back(std::make_shared<std::thread>(task, i * chunk_size, (i + 1) * chunk_size, i));
+    }
+    task(chunk_size * (thread_count - 1), size, thread_count - 1);
+    for (std::size_t i = 0; i < thread_count - 1; ++i)
+    {
+        tasks[i]->join();
+    }
+}
+
+template <typename T>
+template <typename TTASK>
+void kd_tree<T>::_fill_children(typename kd_tree<T>::node *n, std::size_t thread_count,
+                                TTASK fill)
+{
+    // subtrees are independent, so the left one may be built on another thread
+    if (thread_count <= 1 || n->size < parallel_size)
+    {
+        fill(n->left, 1);
+        fill(n->right, 1);
+        return;
+    }
+
+    std::size_t left_threads = thread_count / 2;
+    std::thread left_task(fill, n->left, left_threads);
+    fill(n->right, thread_count - left_threads);
+    left_task.join();
+}
+
+template <typename T>
+void kd_tree<T>::_flatten(const typename kd_tree<T>::node *n,
+                          std::vector<typename kd_tree<T>::flat_node> &nodes,
+                          std::vector<unsigned int> &indices)
+{
+    std::size_t i = nodes.size();
+    nodes.push_back(flat_node());
+    if (n->left && n->right)
+    {
+        nodes[i].split = n->split;
+        nodes[i].info = n->split_dim;
+        _flatten(n->left, nodes, indices);
+        nodes[i].index = nodes.size();
+        _flatten(n->right, nodes, indices);
+    }
+    else
+    {
+        nodes[i].split = 0.0;
+        nodes[i].index = indices.size();
+        nodes[i].info = (n->size << 2) | 3;
+        indices.insert(indices.end(), n->points, n->points + n->size);
+    }
+}
+
+template <typename T>
+typename kd_tree<T>::statistics kd_tree<T>::get_statistics(const sah_params &params) const
+{
+    statistics result;
+    if (empty())
+    {
+        return result;
+    }
+
+    double root_area = range.surface_area();
+    _get_statistics(0, range, 0, root_area > 0.0 ? root_area : 1.0, params, result);
+    if (result.leaf_count > 0)
+    {
+        result.average_leaf_size = (double)result.leaf_points / result.leaf_count;
+    }
+    return result;
+}
+
+template <typename T>
+void kd_tree<T>::_get_statistics(std::size_t i, const aa_cube &range, std::size_t depth,
+                                 double root_area, const sah_params &params,
+                                 statistics &result) const
+{
+    ++result.node_count;
+    if (depth > result.depth)
+    {
+        result.depth = depth;
+    }
+
+    // probability of a ray hitting the root also hitting this node
+    const flat_node &n = nodes[i];
+    double p = range.surface_area() / root_area;
+    if (!n.is_leaf())
+    {
+        result.sah_cost += params.traversal_cost * p;
+        const std::size_t dim = n.split_dim();
+        vector3df left_size = range.size, right_p = range.p, right_size = range.size;
+        left_size.dim[dim] = n.split - range.p.dim[dim];
+        right_p.dim[dim] = n.split;
+        right_size.dim[dim] = range.p.dim[dim] + range.size.dim[dim] - n.split;
+        _get_statistics(i + 1, aa_cube(range.p, left_size), depth + 1,
+                        root_area, params, result);
+        _get_statistics(n.index, aa_cube(right_p, right_size), depth + 1,
+                        root_area, params, result);
+        return;
+    }
+
+    ++result.leaf_count;
+    if (n.size() == 0)
+    {
+        ++result.empty_leaf_count;
+    }
+    if (n.size() > result.max_leaf_size)
     {
-        _fill_node(n->right, points, depth + 1, use_median);
+        result.max_leaf_size = n.size();
     }
+    result.leaf_points += n.size();
+    result.sah_cost += params.intersection_cost * n.size() * p;
 }
 
 #endif // _KD_TREE_HPP_
\ No newline at end of file
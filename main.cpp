@@ -6,6 +6,11 @@
 #include <sstream>
 #include <memory>
 #include <cmath>
+#include <ctime>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <algorithm>
 
 #if defined(_WIN32)
 #include <Windows.h>
@@ -37,8 +42,11 @@
 #include "bezier_curve.h"
 #include "mesh.h"
 #include "mesh_object.h"
+#include "mesh_file.h"
 #include "rotate_bezier.h"
 #include "aa_box.h"
+#include "convergence.h"
+#include "image_writer.h"
 
 // #define DEBUG_PHONG_MODEL 1
 
@@ -88,6 +96,15 @@ int to_int(const std::string &str)
     return i;
 }
 
+double to_double(const std::string &str)
+{
+    std::stringstream ss;
+    ss << str;
+    double d;
+    ss >> d;
+    return d;
+}
+
 int get_cores()
 {
 #if defined(_WIN32)
@@ -104,17 +121,95 @@ int get_cores()
 #endif
 }
 
-void test_bezier()
+bool test_bezier()
 {
     printf("bezier_surface...\n");
     bezier_surface bs = bezier_surface::load("bezier_surface.txt");
     mesh m1 = bs.to_mesh(0.01, 0.01);
-    m1.save("bezier_surface.obj");
+    if (!m1.save("bezier_surface.obj"))
+    {
+        fprintf(stderr, "Cannot write bezier_surface.obj\n");
+        return false;
+    }
 
     printf("bezier_curve...\n");
     bezier_curve bc = bezier_curve::load("bezier_curve.txt");
     mesh m2 = bc.to_rotate_surface_mesh(0.01, 3.6);
-    m2.save("bezier_curve.obj");
+    if (!m2.save("bezier_curve.obj"))
+    {
+        fprintf(stderr, "Cannot write bezier_curve.obj\n");
+        return false;
+    }
+    return true;
+}
+
+void bench_rays()
+{
+    // secondary rays as built by camera::ray_trace: four media deep and back
+    // out, with a reflection at every step
+    constexpr std::size_t count = 10000000;
+    ray r(vector3df::zero, vector3df(0.0, 0.0, -1.0));
+    double sum = 0.0;
+    auto begin_time = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if ((i & 7) < 4)
+        {
+            r = ray(r, r.origin, r.direction, ray::in, 1.1 + (i & 7) * 0.1);
+        }
+        else
+        {
+            r = ray(r, r.origin, r.direction, ray::out);
+        }
+        ray r_reflected(r, r.origin, -r.direction);
+        sum += r_reflected.refractive_index + r_reflected.last_refractive_index();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                   begin_time).count();
+    printf("%.0lf rays/s (checksum %.1lf)\n", count * 2 / seconds, sum);
+}
+
+void bench_bezier()
+{
+    // rotate_bezier::intersect's Newton steps, on a curve of the vase's degree
+    constexpr std::size_t count = 1000000;
+    bezier_curve bc(16);
+    for (std::size_t i = 0; i <= bc.n; ++i)
+    {
+        bc[i] = vector3df(1.0 + 0.5 * sin(i * 0.7), i * 0.25, 0.0);
+    }
+    vector3df point, d_dt, d_dtheta;
+    double sum = 0.0;
+    auto begin_time = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        double t = (i % 1000) / 999.0;
+        bc.get(t, t * 2 * M_PI, point, d_dt, d_dtheta);
+        sum += point.y + d_dt.x + d_dtheta.z;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                   begin_time).count();
+    printf("%.0lf evaluations/s (checksum %.6lf)\n", count / seconds, sum);
+}
+
+// OBJ to the binary mesh format, with the kd-tree
+bool convert_mesh(const std::string &obj_filename, const std::string &filename)
+{
+    mesh m = mesh::load(obj_filename, get_cores());
+    if (m.surfaces.empty())
+    {
+        return false;
+    }
+    mesh_object mo(m, true, get_cores());
+    std::uint64_t size = 0;
+    std::uint64_t hash = mesh_file::hash_file(obj_filename, size);
+    if (!mesh_file::save(filename, mo.get_mesh(), &mo.tree(), hash, size))
+    {
+        fprintf(stderr, "Cannot write %s\n", filename.c_str());
+        return false;
+    }
+    printf("Saved %s\n", filename.c_str());
+    return true;
 }
 
 void init_world(world &w)
@@ -228,9 +323,208 @@ void init_world(world &w)
         vector3df(1.0, 1.0, 0.8)));*/
 }
 
+// fog objects are seeded like the camera, from the command line or a checkpoint
+void seed_fog(world &w, std::uint64_t seed)
+{
+    for (std::size_t i = 0; i < w.object_count(); ++i)
+    {
+        fog *f = dynamic_cast<fog *>(&w.get_object(i));
+        if (f)
+        {
+            f->seed = seed;
+        }
+    }
+}
+
+// photon passes over the hit points of the scene at a quarter of the size,
+// the second pass is timed
+void bench_photons()
+{
+    world w;
+    init_world(w);
+    w.build();
+
+    constexpr int photons = 200000;
+    const std::size_t cores = get_cores();
+    std::vector<std::size_t> thread_counts;
+    for (std::size_t thread_count = 1; thread_count < cores; thread_count *= 2)
+    {
+        thread_counts.push_back(thread_count);
+    }
+    thread_counts.push_back(cores);
+
+    std::vector<double> rates;
+    for (std::size_t thread_count : thread_counts)
+    {
+        imagef img(400, 300);
+        camera c(w, vector3df(0.0, 50.0, 167.0), vector3df(0.0, -0.05, -1.0).normalize(),
+                 vector3df(0.0, 1.0, 0.0));
+        c.thread_count = thread_count;
+        c.aperture = 4.0;
+        c.focal_length = 227;
+        c.aperture_samples = 4;
+        c.film_width = 800.0 * 0.2 * 227 / 167;
+        c.film_height = 600.0 * 0.2 * 227 / 167;
+        c.ray_trace_pass(img);
+        double radius = c.photon_trace_pass(photons, 1.0);
+        auto begin_time = std::chrono::steady_clock::now();
+        c.photon_trace_pass(photons, radius);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                       begin_time).count();
+        rates.push_back(photons / seconds);
+    }
+
+    for (std::size_t i = 0; i < thread_counts.size(); ++i)
+    {
+        printf("%3lu threads: %.0lf photons/s (%.2lfx)\n", thread_counts[i], rates[i],
+               rates[i] / rates[0]);
+    }
+}
+
+// the scene's primary rays traced one by one and as packets of a row, with
+// and without depth of field: rays/s of both, true if the hits are the same
+bool bench_packets()
+{
+    world w;
+    init_world(w);
+    w.build();
+
+    // as the camera in main
+    const std::size_t width = 800, height = 600;
+    const vector3df location(0.0, 50.0, 167.0), front = vector3df(0.0, -0.05, -1.0).normalize();
+    const vector3df right = front.cross(vector3df(0.0, 1.0, 0.0)).normalize(),
+                    up = right.cross(front);
+    const double focal_length = 227, film_width = 800.0 * 0.2 * 227 / 167,
+                 film_height = 600.0 * 0.2 * 227 / 167;
+    std::default_random_engine engine(1);
+    std::uniform_real_distribution<double> dist(-0.5, 0.5);
+
+    bool same = true;
+    for (double aperture : { 0.0, 4.0 })
+    {
+        std::vector<ray> rays;
+        rays.reserve(width * height);
+        for (std::size_t y = 0; y < height; ++y)
+        {
+            for (std::size_t x = 0; x < width; ++x)
+            {
+                const vector3df d = right * ((x + 0.5) * film_width / width - film_width / 2.0) +
+                                    up * ((height - y - 0.5) * film_height / height -
+                                          film_height / 2.0) +
+                                    front * focal_length;
+                const vector3df o = location + right * (dist(engine) * aperture) +
+                                    up * (dist(engine) * aperture);
+                rays.push_back(ray(o, (location + d - o).normalize(), x, y));
+            }
+        }
+
+        std::vector<object *> objs(rays.size()), packet_objs(rays.size());
+        std::vector<double> t(rays.size()), packet_t(rays.size());
+        auto begin_time = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            world_intersect_result wr = w.intersect(rays[i]);
+            objs[i] = wr.succeeded ? &wr.obj : nullptr;
+            t[i] = wr.result.distance;
+        }
+        double single_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                              begin_time).count();
+
+        // width is a multiple of the packet size, a packet stays in its row
+        begin_time = std::chrono::steady_clock::now();
+        ray_packet packet;
+        object *closest_objs[ray_packet::max_size];
+        intersect_result closest_results[ray_packet::max_size];
+        for (std::size_t begin = 0; begin < rays.size(); begin += ray_packet::max_size)
+        {
+            const std::size_t end = std::min(begin + ray_packet::max_size, rays.size());
+            packet.clear();
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                packet.push_back(rays[i]);
+            }
+            w.intersect_packet(packet, closest_objs, closest_results);
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                packet_objs[i] = closest_objs[i - begin];
+                packet_t[i] = closest_results[i - begin].distance;
+            }
+        }
+        double packet_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                              begin_time).count();
+
+        std::size_t different = 0;
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            if (objs[i] != packet_objs[i] || (objs[i] && t[i] != packet_t[i]))
+            {
+                ++different;
+            }
+        }
+        printf("aperture %.1lf: single %.0lf rays/s, packets %.0lf rays/s (%.2lfx), "
+               "%lu different hits\n", aperture, rays.size() / single_seconds,
+               rays.size() / packet_seconds, single_seconds / packet_seconds, different);
+        same = same && different == 0;
+    }
+    return same;
+}
+
 int main(int argc, char **argv)
 {
-    test_bezier();
+    if (argc >= 2 && std::string(argv[1]) == "--bench-rays")
+    {
+        bench_rays();
+        return 0;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench-photons")
+    {
+        bench_photons();
+        return 0;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench-packets")
+    {
+        return bench_packets() ? 0 : 1;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench-bezier")
+    {
+        bench_bezier();
+        return 0;
+    }
+
+    if (argc >= 4 && std::string(argv[1]) == "--convert-mesh")
+    {
+        return convert_mesh(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    // writes bezier_surface.obj and bezier_curve.obj
+    if (argc >= 2 && std::string(argv[1]) == "--tessellate")
+    {
+        return test_bezier() ? 0 : 1;
+    }
+
+    // options before the other arguments: --resume continues from
+    // filename.checkpoint if there is one of this scene, --packets traces
+    // primary rays as packets (see --bench-packets)
+    bool resume = false, use_packets = false;
+    for (; argc >= 2; ++argv, --argc)
+    {
+        const std::string option = argv[1];
+        if (option == "--resume")
+        {
+            resume = true;
+        }
+        else if (option == "--packets")
+        {
+            use_packets = true;
+        }
+        else
+        {
+            break;
+        }
+    }
 
     std::size_t thread_count = get_cores();
     std::string filename = "test.png";
@@ -244,53 +538,166 @@ int main(int argc, char **argv)
         thread_count = to_int(argv[2]);
     }
 
+    std::uint64_t seed = time(nullptr);
+    if (argc >= 4)
+    {
+        seed = to_int(argv[3]);
+    }
+
+    bool use_sppm = argc >= 5 && std::string(argv[4]) == "sppm";
+
+    // 0: no checkpoints, an existing one can still be resumed
+    std::size_t checkpoint_interval = 100;
+    if (argc >= 6)
+    {
+        checkpoint_interval = to_int(argv[5]);
+    }
+    const std::string checkpoint_filename = filename + ".checkpoint";
+
+    // stop once successive estimates change less than this, 0: run all iterations
+    convergence_monitor monitor;
+    if (argc >= 7)
+    {
+        monitor.target = to_double(argv[6]);
+    }
+
     printf("Using %" PRId64 " threads.\n", thread_count);
+    printf("Seed %" PRIu64 ".\n", seed);
 
     world w;
     init_world(w);
+    // an OBJ file in scene coordinates, converted once into <hash>.rtmesh
+    // in the working directory and loaded from there by later runs
+    if (argc >= 8)
+    {
+        std::shared_ptr<mesh_object> mo = mesh_file::load_cached(argv[7], ".", thread_count,
+                                                                 &w.source_hash);
+        if (!mo)
+        {
+            return 1;
+        }
+        w.add_object(mo);
+    }
+    w.build();
 
     imagef img(800, 600);
     camera c(w, vector3df(0.0, 50.0, 167.0), vector3df(0.0, -0.05, -1.0).normalize(), vector3df(0.0, 1.0, 0.0));
     c.thread_count = thread_count;
+    c.use_packets = use_packets;
+    c.seed = seed;
     c.aperture = 4.0;
     c.focal_length = 227;
     c.aperture_samples = 4;
     //c.diffuse_depth = 1;
     c.film_width = 800.0 * 0.2 * 227 / 167;
     c.film_height = 600.0 * 0.2 * 227 / 167;
-    c.ray_trace_pass(img);
 
-#ifndef DEBUG_PHONG_MODEL
-    // PPM
-    int photon_count = 0;
     constexpr int photons = 100000;
-    printf("Iteration (initial)\n");
-    double radius = c.photon_trace_pass(photons, 1.0);
-    photon_count += photons;
-    for (int i = 0; i < 10000; ++i)
+    render_progress progress;
+    progress.seed = seed;
+    const bool resumed = resume &&
+                         c.load_checkpoint(checkpoint_filename, use_sppm, img, progress);
+    if (resumed)
+    {
+        c.seed = progress.seed;
+        printf("Resuming from %s at iteration %" PRIu64 ", with its seed %" PRIu64 ".\n",
+               checkpoint_filename.c_str(), progress.iteration + 1, progress.seed);
+    }
+    else if (resume)
     {
-        printf("Iteration %d\n", i + 1);
-        radius = c.photon_trace_pass(photons, radius);
-        photon_count += photons;
+        fprintf(stderr, "No checkpoint of this scene in %s, starting over.\n",
+                checkpoint_filename.c_str());
+    }
+    seed_fog(w, c.seed);
+
+    // intermediate images are estimated into the writer's back frame and
+    // saved while the next iterations run
+    image_writer writer(img.width, img.height, save_image);
 
-        if (i == 0 || (i + 1) % 10 == 0)
+    if (use_sppm)
+    {
+        // SPPM, eye rays are traced again every iteration
+        for (int i = progress.iteration; i < 10000; ++i)
         {
-            imagef img_copied = img;
-            c.ppm_estimate(img_copied, photon_count);
-            save_image(img_copied, filename + "." + to_string(i + 1) + ".png");
+            printf("Iteration %d\n", i + 1);
+            c.sppm_iteration(img.width, img.height, photons, 1.0);
+            progress.iteration = i + 1;
+
+            if (i == 0 || (i + 1) % 10 == 0)
+            {
+                imagef &frame = writer.back();
+                c.sppm_estimate(frame);
+                monitor.update(frame);
+                writer.submit(filename + "." + to_string(i + 1) + ".png");
+                printf("Change %lf\n", monitor.change());
+            }
+            if (checkpoint_interval && (i + 1) % checkpoint_interval == 0)
+            {
+                c.save_checkpoint(checkpoint_filename, img, progress);
+            }
+            if (monitor.converged())
+            {
+                printf("Converged after %d iterations.\n", i + 1);
+                break;
+            }
         }
+        c.sppm_estimate(img);
     }
-    c.ppm_estimate(img, photon_count);
+    else
+    {
+#ifndef DEBUG_PHONG_MODEL
+        // PPM
+        if (!resumed)
+        {
+            c.ray_trace_pass(img);
+            printf("Iteration (initial)\n");
+            progress.radius = c.photon_trace_pass(photons, 1.0);
+            progress.photon_count += photons;
+        }
+        for (int i = progress.iteration; i < 10000; ++i)
+        {
+            printf("Iteration %d\n", i + 1);
+            progress.radius = c.photon_trace_pass(photons, progress.radius);
+            progress.photon_count += photons;
+            progress.iteration = i + 1;
+
+            if (i == 0 || (i + 1) % 10 == 0)
+            {
+                imagef &frame = writer.back();
+                frame.raw = img.raw;
+                c.ppm_estimate(frame, progress.photon_count);
+                monitor.update(frame);
+                writer.submit(filename + "." + to_string(i + 1) + ".png");
+                printf("Change %lf\n", monitor.change());
+            }
+            if (checkpoint_interval && (i + 1) % checkpoint_interval == 0)
+            {
+                c.save_checkpoint(checkpoint_filename, img, progress);
+            }
+            if (monitor.converged())
+            {
+                printf("Converged after %d iterations.\n", i + 1);
+                break;
+            }
+        }
+        c.ppm_estimate(img, progress.photon_count);
 #endif
 
 #ifdef DEBUG_PHONG_MODEL
-    // Phong
-    c.phong_estimate(img);
+        // Phong
+        c.ray_trace_pass(img);
+        c.phong_estimate(img);
 #endif
+    }
+
+    writer.flush();
+    printf("Waited %.3lf s for intermediate images.\n", writer.wait_seconds());
 
     imagef out(img.width / 2, img.height / 2);
     half_size(img, out);
     save_image(img, filename);
     save_image(out, "ssaa_" + filename);
+    // finished, nothing left to resume
+    remove(checkpoint_filename.c_str());
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "mapped_file.h"
+
+#include <cstdio>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILE_POSIX
+#endif
+
+mapped_file::mapped_file(const std::string &filename)
+{
+#if defined(_WIN32)
+    _file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (_file == INVALID_HANDLE_VALUE)
+    {
+        _file = nullptr;
+        return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size))
+    {
+        return;
+    }
+    _size = (std::size_t)size.QuadPart;
+    _good = true;
+    if (_size == 0)
+    {
+        return;
+    }
+    _mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (_mapping)
+    {
+        _data = (const char *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+        _mapped = _data != nullptr;
+    }
+    if (!_mapped)
+    {
+        _read(filename);
+    }
+#elif defined(MAPPED_FILE_POSIX)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return;
+    }
+    _size = (std::size_t)st.st_size;
+    _good = true;
+    if (_size > 0)
+    {
+        void *p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            _data = (const char *)p;
+            _mapped = true;
+#ifdef MADV_SEQUENTIAL
+            madvise(p, _size, MADV_SEQUENTIAL);
+#endif
+        }
+    }
+    close(fd); // the mapping stays valid
+    if (_size > 0 && !_mapped)
+    {
+        _read(filename);
+    }
+#else
+    _read(filename);
+#endif
+}
+
+mapped_file::~mapped_file()
+{
+#if defined(_WIN32)
+    if (_mapped)
+    {
+        UnmapViewOfFile(_data);
+    }
+    if (_mapping)
+    {
+        CloseHandle(_mapping);
+    }
+    if (_file)
+    {
+        CloseHandle(_file);
+    }
+#elif defined(MAPPED_FILE_POSIX)
+    if (_mapped)
+    {
+        munmap((void *)_data, _size);
+    }
+#endif
+}
+
+void mapped_file::_read(const std::string &filename)
+{
+    _good = false;
+    _data = nullptr;
+    FILE *fd = fopen(filename.c_str(), "rb");
+    if (!fd)
+    {
+        return;
+    }
+    fseek(fd, 0, SEEK_END);
+    long size = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    if (size < 0)
+    {
+        fclose(fd);
+        return;
+    }
+    _buffer.resize((std::size_t)size);
+    _size = fread(_buffer.data(), 1, _buffer.size(), fd);
+    fclose(fd);
+    _data = _buffer.data();
+    _good = _size == _buffer.size();
+}
\ No newline at end of file
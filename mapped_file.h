@@ -0,0 +1,48 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A whole file, read-only, memory-mapped where the system supports it
+// (POSIX and Windows), read into memory otherwise.
+class mapped_file
+{
+private:
+    const char *_data = nullptr;
+    std::size_t _size = 0;
+    bool _good = false;
+    bool _mapped = false;
+    std::vector<char> _buffer; // when not mapped
+#ifdef _WIN32
+    void *_file = nullptr, *_mapping = nullptr;
+#endif
+
+public:
+    explicit mapped_file(const std::string &filename);
+    ~mapped_file();
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool good() const
+    {
+        return _good;
+    }
+
+    const char *data() const
+    {
+        return _data;
+    }
+
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    void _read(const std::string &filename);
+};
+
+#endif // _MAPPED_FILE_H_
\ No newline at end of file
@@ -1,31 +1,707 @@
 #include "mesh.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
-#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <unordered_map>
 
-void mesh::save(const std::string &filename) const
+#include "mapped_file.h"
+
+namespace
+{
+
+// Appends x as printf's "%lf" would. Scales to millionths and rounds; when
+// that might round differently (close to a tie, |x| >= 1e6 where the scaling
+// itself loses a bit too many digits, not finite), asks snprintf.
+void append_fixed(std::string &s, double x)
+{
+    double a = std::fabs(x);
+    double scaled = a * 1e6;
+    double rounded = std::floor(scaled + 0.5);
+    if (!(a < 1e6) || std::fabs(std::fabs(scaled - rounded) - 0.5) < 1e-3)
+    {
+        char buffer[512];
+        int length = snprintf(buffer, sizeof(buffer), "%lf", x);
+        s.append(buffer, length > 0 ? std::min<std::size_t>(length, sizeof(buffer) - 1) : 0);
+        return;
+    }
+
+    std::uint64_t n = (std::uint64_t)rounded;
+    char buffer[32];
+    char *p = buffer + sizeof(buffer);
+    for (std::size_t i = 0; i < 6; ++i)
+    {
+        *--p = '0' + n % 10;
+        n /= 10;
+    }
+    *--p = '.';
+    do
+    {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    if (std::signbit(x))
+    {
+        *--p = '-';
+    }
+    s.append(p, buffer + sizeof(buffer) - p);
+}
+
+void append_index(std::string &s, std::ptrdiff_t i)
+{
+    char buffer[32];
+    char *p = buffer + sizeof(buffer);
+    std::uint64_t n = i < 0 ? (std::uint64_t)-(i + 1) + 1 : (std::uint64_t)i;
+    do
+    {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    if (i < 0)
+    {
+        *--p = '-';
+    }
+    s.append(p, buffer + sizeof(buffer) - p);
+}
+
+// line i of the OBJ written by mesh::save
+void append_line(std::string &s, const mesh &m, std::size_t i)
+{
+    const std::size_t sizes[3] = { m.vertices.size(), m.normals.size(), m.texture.size() };
+    const std::vector<vector3df> *arrays[3] = { &m.vertices, &m.normals, &m.texture };
+    static const char *prefixes[3] = { "v", "vn", "vt" };
+    for (std::size_t kind = 0; kind < 3; ++kind)
+    {
+        if (i < sizes[kind])
+        {
+            const vector3df &v = (*arrays[kind])[i];
+            s += prefixes[kind];
+            for (std::size_t dim = 0; dim < (kind == 2 ? 2 : 3); ++dim)
+            {
+                s += ' ';
+                append_fixed(s, v.dim[dim]);
+            }
+            s += '\n';
+            return;
+        }
+        i -= sizes[kind];
+    }
+    const vector3di &f = m.surfaces[i];
+    s += 'f';
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        s += ' ';
+        append_index(s, f.dim[dim] + 1);
+    }
+    s += '\n';
+}
+
+// what one chunk of an OBJ file holds
+struct obj_chunk
+{
+    std::vector<vector3df> v, vt, vn;
+    // v, vt and vn index of every triangle corner, starting at 0. vt and vn
+    // stay empty until a face gives one (used), then -1 stands for "not given".
+    // Negative (relative) indices count from the start of the chunk until
+    // the chunks are merged, relative[kind] lists where they are.
+    std::vector<std::ptrdiff_t> corners[3];
+    std::vector<std::size_t> relative[3];
+    bool used[3] = { true, false, false };
+    std::size_t skipped_lines = 0;
+};
+
+bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+const char *skip_spaces(const char *p, const char *end)
+{
+    while (p != end && is_space(*p))
+    {
+        ++p;
+    }
+    return p;
+}
+
+// Decimal number at p, like strtod, but without a terminating NUL. Exact
+// when the digits and the power of ten fit in a double, strtod otherwise.
+// Returns the end of the number, or p if there is none.
+const char *parse_double(const char *p, const char *end, double &result)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *begin = p;
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        ++p;
+    }
+
+    std::uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p != end && is_digit(*p); ++p)
+    {
+        any = true;
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        }
+        else
+        {
+            ++exponent;
+        }
+    }
+    if (p != end && *p == '.')
+    {
+        for (++p; p != end && is_digit(*p); ++p)
+        {
+            any = true;
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                --exponent;
+            }
+        }
+    }
+    if (!any)
+    {
+        return begin;
+    }
+    if (p != end && (*p == 'e' || *p == 'E'))
+    {
+        const char *q = p + 1;
+        bool negative_exponent = false;
+        if (q != end && (*q == '-' || *q == '+'))
+        {
+            negative_exponent = *q == '-';
+            ++q;
+        }
+        if (q != end && is_digit(*q))
+        {
+            int e = 0;
+            for (; q != end && is_digit(*q); ++q)
+            {
+                if (e < 100000)
+                {
+                    e = e * 10 + (*q - '0');
+                }
+            }
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+
+    if (mantissa <= ((std::uint64_t)1 << 53) && exponent >= -22 && exponent <= 22)
+    {
+        result = exponent < 0 ? (double)mantissa / powers[-exponent]
+                              : (double)mantissa * powers[exponent];
+    }
+    else
+    {
+        std::string s(begin, p);
+        result = strtod(s.c_str(), nullptr);
+        return p;
+    }
+    if (negative)
+    {
+        result = -result;
+    }
+    return p;
+}
+
+const char *parse_index(const char *p, const char *end, std::ptrdiff_t &result)
+{
+    const char *begin = p;
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        ++p;
+    }
+    if (p == end || !is_digit(*p))
+    {
+        return begin;
+    }
+    result = 0;
+    for (; p != end && is_digit(*p); ++p)
+    {
+        result = result * 10 + (*p - '0');
+    }
+    if (negative)
+    {
+        result = -result;
+    }
+    return p;
+}
+
+// up to three numbers, at least min_count
+bool parse_vector(const char *p, const char *end, std::size_t min_count, vector3df &v)
+{
+    std::size_t count = 0;
+    for (; count < 3; ++count)
+    {
+        p = skip_spaces(p, end);
+        const char *q = parse_double(p, end, v.dim[count]);
+        if (q == p)
+        {
+            break;
+        }
+        p = q;
+    }
+    return count >= min_count;
+}
+
+// "f v v/vt v//vn v/vt/vn ...", triangulated as a fan
+bool parse_face(const char *p, const char *end, obj_chunk &chunk,
+                std::vector<std::ptrdiff_t> &polygon, std::vector<unsigned char> &flags)
+{
+    const std::ptrdiff_t counts[3] = {
+        (std::ptrdiff_t)chunk.v.size(), (std::ptrdiff_t)chunk.vt.size(),
+        (std::ptrdiff_t)chunk.vn.size()
+    };
+
+    // per corner, bit kind: given, bit 3 + kind: relative
+    polygon.clear();
+    flags.clear();
+    unsigned char all_flags = 0;
+    while (true)
+    {
+        p = skip_spaces(p, end);
+        if (p == end)
+        {
+            break;
+        }
+        std::ptrdiff_t corner[3] = { 0, 0, 0 }; // 0: not given
+        for (std::size_t kind = 0; kind < 3; ++kind)
+        {
+            if (kind > 0)
+            {
+                if (p == end || *p != '/')
+                {
+                    break;
+                }
+                ++p;
+            }
+            p = parse_index(p, end, corner[kind]);
+        }
+        if (corner[0] == 0 || (p != end && !is_space(*p)))
+        {
+            return false;
+        }
+        unsigned char f = 0;
+        for (std::size_t kind = 0; kind < 3; ++kind)
+        {
+            // 1-based, or counted back from the last one
+            polygon.push_back(corner[kind] > 0 ? corner[kind] - 1 :
+                              corner[kind] < 0 ? counts[kind] + corner[kind] : -1);
+            f |= (corner[kind] != 0) << kind | (corner[kind] < 0) << (3 + kind);
+        }
+        flags.push_back(f);
+        all_flags |= f;
+    }
+    if (flags.size() < 3)
+    {
+        return false;
+    }
+
+    for (std::size_t kind = 1; kind < 3; ++kind)
+    {
+        if ((all_flags >> kind & 1) && !chunk.used[kind])
+        {
+            chunk.corners[kind].resize(chunk.corners[0].size(), -1);
+            chunk.used[kind] = true;
+        }
+    }
+    for (std::size_t t = 0; t + 2 < flags.size(); ++t)
+    {
+        const std::size_t triangle[3] = { 0, t + 1, t + 2 };
+        for (std::size_t i : triangle)
+        {
+            for (std::size_t kind = 0; kind < 3; ++kind)
+            {
+                std::vector<std::ptrdiff_t> &corners = chunk.corners[kind];
+                if (!chunk.used[kind])
+                {
+                    continue;
+                }
+                if (flags[i] >> (3 + kind) & 1)
+                {
+                    chunk.relative[kind].push_back(corners.size());
+                }
+                corners.push_back(polygon[i * 3 + kind]);
+            }
+        }
+    }
+    return true;
+}
+
+void parse_chunk(const char *p, const char *end, obj_chunk &chunk)
+{
+    std::vector<std::ptrdiff_t> polygon;
+    std::vector<unsigned char> flags;
+    while (p != end)
+    {
+        const char *line_end = (const char *)memchr(p, '\n', end - p);
+        if (!line_end)
+        {
+            line_end = end;
+        }
+        const char *q = skip_spaces(p, line_end);
+        bool ok = true;
+        if (line_end - q >= 2 && q[0] == 'v' && is_space(q[1]))
+        {
+            chunk.v.push_back(vector3df::zero);
+            ok = parse_vector(q + 2, line_end, 3, chunk.v.back());
+        }
+        else if (line_end - q >= 3 && q[0] == 'v' && q[1] == 'n' && is_space(q[2]))
+        {
+            chunk.vn.push_back(vector3df::zero);
+            ok = parse_vector(q + 3, line_end, 3, chunk.vn.back());
+        }
+        else if (line_end - q >= 3 && q[0] == 'v' && q[1] == 't' && is_space(q[2]))
+        {
+            chunk.vt.push_back(vector3df::zero);
+            ok = parse_vector(q + 3, line_end, 1, chunk.vt.back());
+        }
+        else if (line_end - q >= 2 && q[0] == 'f' && is_space(q[1]))
+        {
+            ok = parse_face(q + 2, line_end, chunk, polygon, flags);
+        }
+        // comments, groups, materials, lines etc. are ignored
+        if (!ok)
+        {
+            ++chunk.skipped_lines;
+        }
+        p = line_end == end ? end : line_end + 1;
+    }
+}
+
+struct corner_key
+{
+    std::ptrdiff_t v, vt, vn;
+
+    bool operator==(const corner_key &k) const
+    {
+        return v == k.v && vt == k.vt && vn == k.vn;
+    }
+};
+
+struct corner_hash
+{
+    std::size_t operator()(const corner_key &k) const
+    {
+        return (std::size_t)(k.v * 73856093) ^ (std::size_t)(k.vt * 19349663) ^
+               (std::size_t)(k.vn * 83492791);
+    }
+};
+
+}
+
+bool mesh::save(const std::string &filename, std::size_t thread_count) const
 {
-    // TODO: more c++
     FILE *fd = fopen(filename.c_str(), "w");
-    for (const auto &v : vertices)
+    if (!fd)
+    {
+        return false;
+    }
+
+    // batches of chunk_size lines per thread are formatted in parallel,
+    // then written in order, one fwrite per chunk
+    constexpr std::size_t chunk_size = 1 << 16;
+    if (thread_count == 0)
     {
-        fprintf(fd, "v %lf %lf %lf\n", v.x, v.y, v.z);
+        thread_count = 1;
+    }
+    const std::size_t line_count = vertices.size() + normals.size() + texture.size() +
+                                   surfaces.size();
+    std::vector<std::string> buffers(thread_count);
+    bool good = true;
+    for (std::size_t batch = 0; batch < line_count && good; batch += chunk_size * thread_count)
+    {
+        const std::size_t chunk_count =
+            std::min(thread_count, (line_count - batch + chunk_size - 1) / chunk_size);
+        auto format = [&](std::size_t chunk)
+        {
+            std::string &s = buffers[chunk];
+            s.clear();
+            const std::size_t begin = batch + chunk * chunk_size;
+            const std::size_t end = std::min(begin + chunk_size, line_count);
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                append_line(s, *this, i);
+            }
+        };
+        std::vector<std::shared_ptr<std::thread> > threads;
+        for (std::size_t chunk = 1; chunk < chunk_count; ++chunk)
+        {
+            threads.push_back(std::make_shared<std::thread>(format, chunk));
+        }
+        format(0);
+        for (auto &t : threads)
+        {
+            t->join();
+        }
+        for (std::size_t chunk = 0; chunk < chunk_count && good; ++chunk)
+        {
+            good = fwrite(buffers[chunk].data(), 1, buffers[chunk].size(), fd) ==
+                   buffers[chunk].size();
+        }
     }
 
-    for (const auto &v : normals)
+    return fclose(fd) == 0 && good;
+}
+
+mesh mesh::load(const std::string &filename, std::size_t thread_count)
+{
+    mesh result;
+    auto begin_time = std::chrono::steady_clock::now();
+    mapped_file file(filename);
+    if (!file.good())
     {
-        fprintf(fd, "vn %lf %lf %lf\n", v.x, v.y, v.z);
+        fprintf(stderr, "Cannot open %s\n", filename.c_str());
+        return result;
     }
 
-    for (const auto &v : texture)
+    // chunks of at least 1 MiB, a few per thread, split after a newline
+    if (thread_count == 0)
     {
-        fprintf(fd, "vt %lf %lf\n", v.x, v.y);
+        thread_count = 1;
+    }
+    const char *data = file.data(), *data_end = data + file.size();
+    std::size_t chunk_count = std::min(file.size() / (1 << 20) + 1, thread_count * 4);
+    std::vector<const char *> bounds(chunk_count + 1, data_end);
+    bounds[0] = data;
+    for (std::size_t i = 1; i < chunk_count; ++i)
+    {
+        const char *p = data + file.size() / chunk_count * i;
+        if (p < bounds[i - 1])
+        {
+            p = bounds[i - 1];
+        }
+        const char *newline = (const char *)memchr(p, '\n', data_end - p);
+        bounds[i] = newline ? newline + 1 : data_end;
     }
 
-    for (const auto &f : surfaces)
+    std::vector<obj_chunk> chunks(chunk_count);
+    std::atomic<std::size_t> next_chunk(0);
+    auto parse = [&]()
+    {
+        for (std::size_t i = next_chunk++; i < chunk_count; i = next_chunk++)
+        {
+            parse_chunk(bounds[i], bounds[i + 1], chunks[i]);
+        }
+    };
+    std::vector<std::shared_ptr<std::thread> > threads;
+    for (std::size_t i = 1; i < std::min(thread_count, chunk_count); ++i)
+    {
+        threads.push_back(std::make_shared<std::thread>(parse));
+    }
+    parse();
+    for (auto &t : threads)
     {
-        fprintf(fd, "f %" PRId64 " %" PRId64 " %" PRId64 "\n", f.x + 1, f.y + 1, f.z + 1);
+        t->join();
     }
 
-    fclose(fd);
+    // make relative indices absolute
+    std::size_t sizes[4] = { 0, 0, 0, 0 }; // v, vt, vn, corners
+    std::size_t skipped_lines = 0;
+    bool use_kind[3] = { true, false, false };
+    for (obj_chunk &chunk : chunks)
+    {
+        const std::size_t offsets[3] = { sizes[0], sizes[1], sizes[2] };
+        for (std::size_t kind = 0; kind < 3; ++kind)
+        {
+            for (std::size_t position : chunk.relative[kind])
+            {
+                chunk.corners[kind][position] += offsets[kind];
+            }
+            use_kind[kind] = use_kind[kind] || chunk.used[kind];
+        }
+        sizes[0] += chunk.v.size();
+        sizes[1] += chunk.vt.size();
+        sizes[2] += chunk.vn.size();
+        sizes[3] += chunk.corners[0].size();
+        skipped_lines += chunk.skipped_lines;
+    }
+    auto corner = [&](const obj_chunk &chunk, std::size_t kind, std::size_t i)
+    {
+        return chunk.used[kind] ? chunk.corners[kind][i] : -1;
+    };
+
+    // drop triangles with an index out of range, see whether v, vt and vn
+    // go together (as written by save)
+    std::size_t triangle_count = 0, skipped_triangles = 0;
+    bool all_vn = true, direct = true;
+    std::vector<std::vector<bool> > valid(chunk_count);
+    for (std::size_t c = 0; c < chunk_count; ++c)
+    {
+        const obj_chunk &chunk = chunks[c];
+        valid[c].resize(chunk.corners[0].size() / 3);
+        for (std::size_t t = 0; t < valid[c].size(); ++t)
+        {
+            bool ok = true;
+            for (std::size_t i = t * 3; i < t * 3 + 3; ++i)
+            {
+                ok = ok && chunk.corners[0][i] >= 0 && (std::size_t)chunk.corners[0][i] < sizes[0];
+                for (std::size_t kind = 1; kind < 3; ++kind)
+                {
+                    std::ptrdiff_t index = corner(chunk, kind, i);
+                    ok = ok && index >= -1 && index < (std::ptrdiff_t)sizes[kind];
+                }
+            }
+            valid[c][t] = ok;
+            if (!ok)
+            {
+                ++skipped_triangles;
+                continue;
+            }
+            ++triangle_count;
+            for (std::size_t i = t * 3; i < t * 3 + 3; ++i)
+            {
+                std::ptrdiff_t v = chunk.corners[0][i], vt = corner(chunk, 1, i),
+                               vn = corner(chunk, 2, i);
+                all_vn = all_vn && vn >= 0;
+                direct = direct && (vt < 0 || vt == v) && (vn < 0 || vn == v);
+            }
+        }
+    }
+    direct = direct && (!use_kind[1] || sizes[1] == sizes[0]) &&
+             (!use_kind[2] || sizes[2] == sizes[0]);
+
+    std::vector<vector3df> v, vt, vn;
+    v.reserve(sizes[0]);
+    vt.reserve(sizes[1]);
+    vn.reserve(sizes[2]);
+    for (obj_chunk &chunk : chunks)
+    {
+        v.insert(v.end(), chunk.v.begin(), chunk.v.end());
+        vt.insert(vt.end(), chunk.vt.begin(), chunk.vt.end());
+        vn.insert(vn.end(), chunk.vn.begin(), chunk.vn.end());
+        std::vector<vector3df>().swap(chunk.v); // free as we go
+        std::vector<vector3df>().swap(chunk.vt);
+        std::vector<vector3df>().swap(chunk.vn);
+    }
+
+    result.surfaces.resize(triangle_count);
+    if (direct)
+    {
+        std::size_t s = 0;
+        for (std::size_t c = 0; c < chunk_count; ++c)
+        {
+            const std::vector<std::ptrdiff_t> &corners = chunks[c].corners[0];
+            for (std::size_t t = 0; t < valid[c].size(); ++t)
+            {
+                if (valid[c][t])
+                {
+                    result.surfaces[s++] = vector3di(corners[t * 3], corners[t * 3 + 1],
+                                                     corners[t * 3 + 2]);
+                }
+            }
+        }
+        result.vertices.swap(v);
+        if (vn.size() == result.vertices.size())
+        {
+            result.normals.swap(vn);
+        }
+        if (vt.size() == result.vertices.size())
+        {
+            result.texture.swap(vt);
+        }
+    }
+    else
+    {
+        // one vertex per distinct v/vt/vn, normals only if every corner has one
+        std::vector<std::ptrdiff_t> first(v.size(), -1); // first vertex made from a v
+        std::unordered_map<corner_key, std::ptrdiff_t, corner_hash> others;
+        std::vector<corner_key> keys;
+        std::size_t s = 0;
+        for (std::size_t c = 0; c < chunk_count; ++c)
+        {
+            const obj_chunk &chunk = chunks[c];
+            for (std::size_t t = 0; t < valid[c].size(); ++t)
+            {
+                if (!valid[c][t])
+                {
+                    continue;
+                }
+                for (std::size_t k = 0; k < 3; ++k)
+                {
+                    const std::size_t i = t * 3 + k;
+                    corner_key key = { chunk.corners[0][i], corner(chunk, 1, i),
+                                       all_vn ? corner(chunk, 2, i) : -1 };
+                    std::ptrdiff_t index = first[key.v];
+                    if (index < 0)
+                    {
+                        index = first[key.v] = keys.size();
+                        keys.push_back(key);
+                    }
+                    else if (!(keys[index] == key))
+                    {
+                        auto it = others.find(key);
+                        if (it == others.end())
+                        {
+                            it = others.insert(std::make_pair(key, (std::ptrdiff_t)keys.size())).first;
+                            keys.push_back(key);
+                        }
+                        index = it->second;
+                    }
+                    result.surfaces[s].dim[k] = index;
+                }
+                ++s;
+            }
+        }
+
+        result.vertices.resize(keys.size());
+        for (std::size_t i = 0; i < keys.size(); ++i)
+        {
+            result.vertices[i] = v[keys[i].v];
+        }
+        if (use_kind[1])
+        {
+            result.texture.resize(keys.size());
+            for (std::size_t i = 0; i < keys.size(); ++i)
+            {
+                result.texture[i] = keys[i].vt >= 0 ? vt[keys[i].vt] : vector3df::zero;
+            }
+        }
+        if (use_kind[2] && all_vn)
+        {
+            result.normals.resize(keys.size());
+            for (std::size_t i = 0; i < keys.size(); ++i)
+            {
+                result.normals[i] = vn[keys[i].vn];
+            }
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                   begin_time).count();
+    double megabytes = file.size() / 1048576.0;
+    printf("Loaded %s: %lu vertices, %lu triangles, %.1lf MB in %.3lfs (%.1lf MB/s)\n",
+           filename.c_str(), result.vertices.size(), result.surfaces.size(),
+           megabytes, seconds, seconds > 0.0 ? megabytes / seconds : 0.0);
+    if (skipped_lines > 0 || skipped_triangles > 0)
+    {
+        fprintf(stderr, "%s: skipped %lu malformed lines and %lu triangles with bad indices\n",
+                filename.c_str(), skipped_lines, skipped_triangles);
+    }
+    return result;
 }
\ No newline at end of file
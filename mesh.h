@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <thread>
 
 #include "vector3d.hpp"
 
@@ -14,8 +15,14 @@ public:
     std::vector<vector3df> texture; // texture coordinates of vertices
     std::vector<vector3di> surfaces; // triangles, stores index of vertices, starts at 0
 
-    void save(const std::string &filename) const;
-    static mesh load(const std::string &filename); // TODO
+    // Wavefront OBJ, numbers as "%lf", formatted in parallel
+    bool save(const std::string &filename,
+              std::size_t thread_count = std::thread::hardware_concurrency()) const;
+    // Wavefront OBJ: v, vt, vn and f (polygons are triangulated), anything
+    // else is ignored. Parsed in parallel from a memory-mapped file. Corners
+    // whose v, vt and vn differ get vertices of their own.
+    static mesh load(const std::string &filename,
+                     std::size_t thread_count = std::thread::hardware_concurrency());
 };
 
 #endif // _MESH_H_
\ No newline at end of file
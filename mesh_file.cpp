@@ -0,0 +1,338 @@
+#include "mesh_file.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "mapped_file.h"
+
+namespace
+{
+
+std::uint64_t padded(std::uint64_t size)
+{
+    return (size + 7) / 8 * 8;
+}
+
+bool write_array(FILE *fd, const void *data, std::size_t size)
+{
+    static const char zeros[8] = { 0 };
+    const std::size_t padding = padded(size) - size;
+    return (size == 0 || fwrite(data, 1, size, fd) == size) &&
+           (padding == 0 || fwrite(zeros, 1, padding, fd) == padding);
+}
+
+// triangles are stored as three 64-bit integers
+bool write_triangles(FILE *fd, const std::vector<vector3di> &surfaces)
+{
+    if (sizeof(vector3di) == 3 * sizeof(std::int64_t))
+    {
+        return write_array(fd, surfaces.data(), surfaces.size() * sizeof(vector3di));
+    }
+    std::vector<std::int64_t> values(surfaces.size() * 3);
+    for (std::size_t i = 0; i < values.size(); ++i)
+    {
+        values[i] = surfaces[i / 3].dim[i % 3];
+    }
+    return write_array(fd, values.data(), values.size() * sizeof(std::int64_t));
+}
+
+void read_triangles(const char *data, std::vector<vector3di> &surfaces)
+{
+    if (sizeof(vector3di) == 3 * sizeof(std::int64_t))
+    {
+        if (!surfaces.empty())
+        {
+            memcpy((void *)surfaces.data(), data, surfaces.size() * sizeof(vector3di));
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < surfaces.size() * 3; ++i)
+    {
+        std::int64_t value;
+        memcpy(&value, data + i * sizeof(value), sizeof(value));
+        surfaces[i / 3].dim[i % 3] = (std::ptrdiff_t)value;
+    }
+}
+
+template <typename T>
+void read_array(const char *data, std::vector<T> &v)
+{
+    if (!v.empty())
+    {
+        memcpy((void *)v.data(), data, v.size() * sizeof(T));
+    }
+}
+
+bool valid_tree(const kd_tree<triangle_index> &tree, std::size_t triangle_count)
+{
+    // children come after their parent and no deeper than max_depth, as built,
+    // every node but the root has exactly one parent. depth 0: not reached
+    std::vector<unsigned char> depth(tree.nodes.size());
+    if (!depth.empty())
+    {
+        depth[0] = 1;
+    }
+    for (std::size_t i = 0; i < tree.nodes.size(); ++i)
+    {
+        const kd_tree<triangle_index>::flat_node &n = tree.nodes[i];
+        if (depth[i] == 0)
+        {
+            return false;
+        }
+        if (n.is_leaf())
+        {
+            if ((std::size_t)n.index + n.size() > tree.indices.size())
+            {
+                return false;
+            }
+            continue;
+        }
+        if (n.index <= i + 1 || n.index >= tree.nodes.size() ||
+            depth[i] > kd_tree<triangle_index>::max_depth ||
+            depth[i + 1] != 0 || depth[n.index] != 0)
+        {
+            return false;
+        }
+        depth[i + 1] = depth[n.index] = depth[i] + 1;
+    }
+    for (unsigned int index : tree.indices)
+    {
+        if (index >= triangle_count)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+bool mesh_file::save(const std::string &filename, const mesh &m,
+                     const kd_tree<triangle_index> *tree,
+                     std::uint64_t source_hash, std::uint64_t source_size)
+{
+    header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = mesh_file_magic;
+    h.version = mesh_file_version;
+    h.source_hash = source_hash;
+    h.source_size = source_size;
+    h.vertex_count = m.vertices.size();
+    h.normal_count = m.normals.size();
+    h.texture_count = m.texture.size();
+    h.triangle_count = m.surfaces.size();
+    if (tree && !tree->empty())
+    {
+        h.node_count = tree->nodes.size();
+        h.index_count = tree->indices.size();
+        for (std::size_t dim = 0; dim < 3; ++dim)
+        {
+            h.range[dim] = tree->range.p.dim[dim];
+            h.range[3 + dim] = tree->range.size.dim[dim];
+        }
+    }
+
+    // like checkpoint_writer, a crash while writing keeps the old file
+    std::string temp_filename = filename + ".tmp";
+    FILE *fd = fopen(temp_filename.c_str(), "wb");
+    if (!fd)
+    {
+        return false;
+    }
+    bool good = write_array(fd, &h, sizeof(h)) &&
+                write_array(fd, m.vertices.data(), m.vertices.size() * sizeof(vector3df)) &&
+                write_array(fd, m.normals.data(), m.normals.size() * sizeof(vector3df)) &&
+                write_array(fd, m.texture.data(), m.texture.size() * sizeof(vector3df)) &&
+                write_triangles(fd, m.surfaces);
+    if (good && h.node_count > 0)
+    {
+        good = write_array(fd, tree->nodes.data(),
+                           tree->nodes.size() * sizeof(kd_tree<triangle_index>::flat_node)) &&
+               write_array(fd, tree->indices.data(), tree->indices.size() * sizeof(unsigned int));
+    }
+    good = fclose(fd) == 0 && good;
+    if (!good)
+    {
+        remove(temp_filename.c_str());
+        return false;
+    }
+    if (rename(temp_filename.c_str(), filename.c_str()) != 0)
+    {
+        // Windows does not replace an existing file
+        remove(filename.c_str());
+        return rename(temp_filename.c_str(), filename.c_str()) == 0;
+    }
+    return true;
+}
+
+bool mesh_file::load(const std::string &filename, mesh &m, kd_tree<triangle_index> &tree,
+                     header *h)
+{
+    mapped_file file(filename);
+    header hd;
+    if (!file.good() || file.size() < sizeof(hd))
+    {
+        return false;
+    }
+    memcpy(&hd, file.data(), sizeof(hd));
+    if (hd.magic != mesh_file_magic || hd.version != mesh_file_version)
+    {
+        return false;
+    }
+
+    // where the arrays are, the counts are checked before they are multiplied
+    const std::uint64_t counts[6] = {
+        hd.vertex_count, hd.normal_count, hd.texture_count, hd.triangle_count,
+        hd.node_count, hd.index_count
+    };
+    const std::uint64_t element_sizes[6] = {
+        sizeof(vector3df), sizeof(vector3df), sizeof(vector3df), 3 * sizeof(std::int64_t),
+        sizeof(kd_tree<triangle_index>::flat_node), sizeof(unsigned int)
+    };
+    std::uint64_t offsets[6];
+    std::uint64_t offset = padded(sizeof(hd));
+    for (std::size_t i = 0; i < 6; ++i)
+    {
+        if (counts[i] > file.size())
+        {
+            return false;
+        }
+        offsets[i] = offset;
+        offset += padded(counts[i] * element_sizes[i]);
+    }
+    if (offset > file.size() ||
+        (hd.normal_count != 0 && hd.normal_count != hd.vertex_count) ||
+        (hd.texture_count != 0 && hd.texture_count != hd.vertex_count) ||
+        (hd.node_count == 0) != (hd.index_count == 0))
+    {
+        return false;
+    }
+
+    mesh result;
+    result.vertices.resize(hd.vertex_count);
+    result.normals.resize(hd.normal_count);
+    result.texture.resize(hd.texture_count);
+    result.surfaces.resize(hd.triangle_count);
+    read_array(file.data() + offsets[0], result.vertices);
+    read_array(file.data() + offsets[1], result.normals);
+    read_array(file.data() + offsets[2], result.texture);
+    read_triangles(file.data() + offsets[3], result.surfaces);
+    for (const vector3di &tri : result.surfaces)
+    {
+        for (std::size_t i = 0; i < 3; ++i)
+        {
+            if (tri.dim[i] < 0 || (std::uint64_t)tri.dim[i] >= hd.vertex_count)
+            {
+                return false;
+            }
+        }
+    }
+
+    kd_tree<triangle_index> result_tree;
+    if (hd.node_count > 0)
+    {
+        result_tree.nodes.resize(hd.node_count);
+        result_tree.indices.resize(hd.index_count);
+        read_array(file.data() + offsets[4], result_tree.nodes);
+        read_array(file.data() + offsets[5], result_tree.indices);
+        result_tree.range = aa_cube(vector3df(hd.range[0], hd.range[1], hd.range[2]),
+                                    vector3df(hd.range[3], hd.range[4], hd.range[5]));
+        if (!valid_tree(result_tree, hd.triangle_count))
+        {
+            return false;
+        }
+    }
+
+    m = std::move(result);
+    tree = std::move(result_tree);
+    if (h)
+    {
+        *h = hd;
+    }
+    return true;
+}
+
+std::uint64_t mesh_file::hash_file(const std::string &filename, std::uint64_t &size)
+{
+    mapped_file file(filename);
+    size = file.good() ? file.size() : 0;
+    if (!file.good())
+    {
+        return 0;
+    }
+
+    // eight bytes at a time, with the mixing steps of MurmurHash3's finalizer
+    const char *data = file.data();
+    std::uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= file.size(); i += 8)
+    {
+        std::uint64_t w;
+        memcpy(&w, data + i, 8);
+        h ^= w;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    std::uint64_t w = 0;
+    memcpy(&w, data + i, file.size() - i);
+    h ^= w;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h != 0 ? h : 1;
+}
+
+std::shared_ptr<mesh_object> mesh_file::load_cached(const std::string &obj_filename,
+                                                    const std::string &directory,
+                                                    std::size_t thread_count,
+                                                    std::uint64_t *source_hash)
+{
+    auto begin_time = std::chrono::steady_clock::now();
+    std::uint64_t size = 0;
+    std::uint64_t hash = hash_file(obj_filename, size);
+    if (hash == 0)
+    {
+        fprintf(stderr, "Cannot open %s\n", obj_filename.c_str());
+        return nullptr;
+    }
+    if (source_hash)
+    {
+        *source_hash = hash;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".rtmesh", hash);
+    std::string cache_filename = directory + "/" + name;
+    mesh m;
+    kd_tree<triangle_index> tree;
+    header h;
+    if (load(cache_filename, m, tree, &h) && h.source_hash == hash && h.source_size == size &&
+        !tree.empty())
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                       begin_time).count();
+        printf("Loaded %s from %s in %.3lfs\n", obj_filename.c_str(), cache_filename.c_str(),
+               seconds);
+        return std::make_shared<mesh_object>(m, tree);
+    }
+
+    m = mesh::load(obj_filename, thread_count);
+    if (m.surfaces.empty())
+    {
+        return nullptr;
+    }
+    std::shared_ptr<mesh_object> result = std::make_shared<mesh_object>(m, true, thread_count);
+    if (save(cache_filename, result->get_mesh(), &result->tree(), hash, size))
+    {
+        printf("Saved %s\n", cache_filename.c_str());
+    }
+    else
+    {
+        fprintf(stderr, "Cannot write %s\n", cache_filename.c_str());
+    }
+    return result;
+}
\ No newline at end of file
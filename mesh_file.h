@@ -0,0 +1,57 @@
+#ifndef _MESH_FILE_H_
+#define _MESH_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "mesh.h"
+#include "mesh_object.h"
+
+const std::uint32_t mesh_file_magic = 0x48534d52; // "RMSH"
+const std::uint32_t mesh_file_version = 1;
+
+// Binary meshes: a header, then vertices, normals, texture coordinates and
+// triangles of a mesh and, optionally, the kd-tree of a mesh_object made
+// from it, every array at an offset aligned to 8 bytes. Raw values in the
+// machine's byte order, like checkpoints. Loading maps the file and copies
+// the arrays as they are, nothing is parsed or rebuilt.
+class mesh_file
+{
+public:
+    struct header
+    {
+        std::uint32_t magic, version;
+        std::uint64_t source_hash, source_size; // of the OBJ it was made from, or 0
+        std::uint64_t vertex_count, normal_count, texture_count, triangle_count;
+        std::uint64_t node_count, index_count; // of the kd-tree, 0 if there is none
+        double range[6]; // of the kd-tree: corner and size
+    };
+
+    // tree may be nullptr
+    static bool save(const std::string &filename, const mesh &m,
+                     const kd_tree<triangle_index> *tree = nullptr,
+                     std::uint64_t source_hash = 0, std::uint64_t source_size = 0);
+
+    // tree is left empty if the file has none. Fails on a file of another
+    // version or with indices out of range.
+    static bool load(const std::string &filename, mesh &m, kd_tree<triangle_index> &tree,
+                     header *h = nullptr);
+
+    // of the contents, 0 if the file cannot be read
+    static std::uint64_t hash_file(const std::string &filename, std::uint64_t &size);
+
+    // An OBJ file through a cache: directory/<hash of the OBJ>.rtmesh is used
+    // if it is there, otherwise the OBJ is loaded, the kd-tree built and the
+    // cache written. directory has to exist. source_hash, if given, is set
+    // to the hash of the OBJ.
+    static std::shared_ptr<mesh_object> load_cached(const std::string &obj_filename,
+                                                    const std::string &directory,
+                                                    std::size_t thread_count =
+                                                        std::thread::hardware_concurrency(),
+                                                    std::uint64_t *source_hash = nullptr);
+};
+
+#endif // _MESH_FILE_H_
\ No newline at end of file
@@ -1,33 +1,72 @@
 #include "mesh_object.h"
 
+#include <algorithm>
+#include <limits>
+
 const mesh_object::triangle_intersect_result
 mesh_object::triangle_intersect_result::failed(false);
 
-mesh_object::mesh_object(const mesh &m)
+mesh_object::mesh_object(const mesh &m, bool use_sah, std::size_t thread_count)
     : object(), _mesh(m), _v(_mesh.vertices), _tri(_mesh.surfaces),
       _n(m.vertices.size()), _caches(m.surfaces.size())
 {
+    _init();
+
     std::vector<triangle_index> kd_points;
+    kd_points.reserve(_tri.size());
+    for (std::size_t i = 0; i < _tri.size(); ++i)
+    {
+        kd_points.push_back(triangle_index(*this, i));
+    }
+
+    printf("Building kd-tree (mesh)...\n");
+    if (use_sah)
+    {
+        _kdt = kd_tree<triangle_index>::build_sah(kd_points.begin(), kd_points.end(),
+                                                  kd_tree<triangle_index>::sah_params(),
+                                                  thread_count);
+    }
+    else
+    {
+        _kdt = kd_tree<triangle_index>::build(kd_points.begin(), kd_points.end(), true,
+                                              thread_count);
+    }
+
+    std::vector<triangle_index>().swap(_kdt.points); // only needed while building
+
+    _print_statistics();
+    _pack_triangles();
+}
+
+mesh_object::mesh_object(const mesh &m, const kd_tree<triangle_index> &tree)
+    : object(), _mesh(m), _v(_mesh.vertices), _tri(_mesh.surfaces),
+      _n(m.vertices.size()), _caches(m.surfaces.size()), _kdt(tree)
+{
+    _init();
+    _print_statistics();
+    _pack_triangles();
+}
+
+void mesh_object::_init()
+{
     std::vector<double> count(_mesh.vertices.size());
     for (std::size_t i = 0; i < _tri.size(); ++i)
     {
         const vector3di &tri = _tri[i];
         const vector3df &a = _v[tri.x], &b = _v[tri.y], &c = _v[tri.z];
 
-        kd_points.push_back(triangle_index(*this, i));
-    
         // make cache
         triangle_cache cache;
         vector3df E1 = a - b;
         vector3df E2 = a - c;
-        cache.E1xE2 = E1.cross(E2);
-        cache.n = cache.E1xE2.normalize();
+        vector3df E1xE2 = E1.cross(E2);
+        cache.n = E1xE2.normalize();
         _caches[i] = cache;
 
-        if (m.normals.size() == 0)
+        if (_mesh.normals.size() == 0)
         {
             // make normal vector and its count
-            double area = cache.E1xE2.length() / 2.0; // = weight
+            double area = E1xE2.length() / 2.0; // = weight
             if (area > eps)
             {
                 vector3df weighted_n = cache.n * area;
@@ -41,7 +80,7 @@ mesh_object::mesh_object(const mesh &m)
         }
     }
 
-    if (m.normals.size() == 0)
+    if (_mesh.normals.size() == 0)
     {
         // calc normal vectors of vertices
         for (std::size_t i = 0; i < _v.size(); ++i)
@@ -51,42 +90,72 @@ mesh_object::mesh_object(const mesh &m)
     }
     else
     {
-        _n = m.normals; // just copy
+        _n = _mesh.normals; // just copy
     }
-
-    printf("Building kd-tree (mesh)...\n");
-    _kdt = kd_tree<triangle_index>::build(kd_points.begin(), kd_points.end(), true);
 }
 
-intersect_result mesh_object::intersect(const ray &r) const
+void mesh_object::_print_statistics() const
 {
-    // TODO: performance improve
-    std::vector<intersect_result> results = intersect_all(r);
-    intersect_result *closest_result = nullptr;
+    kd_tree<triangle_index>::statistics stat = _kdt.get_statistics();
+    printf("%lu nodes, %lu leaves (%lu empty), depth %lu, "
+           "%.2lf (max %lu) triangles per leaf, SAH cost %.2lf\n",
+           stat.node_count, stat.leaf_count, stat.empty_leaf_count, stat.depth,
+           stat.average_leaf_size, stat.max_leaf_size, stat.sah_cost);
+}
 
-    for (intersect_result &ir : results)
+void mesh_object::_pack_triangles()
+{
+    // in the order the leaves first use them, so a leaf's triangles are
+    // mostly next to each other in memory
+    const unsigned int unused = static_cast<unsigned int>(-1);
+    std::vector<unsigned int> slot(_tri.size(), unused);
+    _triangles.clear();
+    _triangles.reserve(_tri.size());
+    _triangle_refs.resize(_kdt.indices.size());
+    for (std::size_t i = 0; i < _kdt.indices.size(); ++i)
     {
-        if (!closest_result || ir.distance < closest_result->distance)
+        const unsigned int index = _kdt.indices[i];
+        if (slot[index] == unused)
         {
-            closest_result = &ir;
+            const vector3df &a = _v[_tri[index].x], &b = _v[_tri[index].y],
+                            &c = _v[_tri[index].z];
+            triangle_block::triangle t;
+            t.a = a;
+            t.E1 = a - b;
+            t.E2 = a - c;
+            slot[index] = _triangles.size();
+            _triangles.push_back(t);
         }
+        _triangle_refs[i] = slot[index];
     }
+    printf("%lu triangles (%.1lf MB), blocks of %lu in leaves of %lu or more, %s kernel\n",
+           _triangles.size(),
+           (_triangles.size() * sizeof(triangle_block::triangle) +
+            _triangle_refs.size() * sizeof(unsigned int)) / 1048576.0,
+           triangle_block::size, triangle_block::min_count, triangle_block::kernel_name());
+}
 
-    if (closest_result)
-    {
-        return *closest_result;
-    }
-    else
+intersect_result mesh_object::intersect(const ray &r) const
+{
+    triangle_intersect_result tir = _intersect(r);
+    if (!tir.succeeded)
     {
         return intersect_result::failed;
     }
+
+    return intersect_result(r.origin + r.direction * tir.t, get_normal_vector(tir), tir.t,
+                            tir.alpha, tir.beta, tir.index);
 }
 
 std::vector<intersect_result> mesh_object::intersect_all(const ray &r) const
 {
     // deduplicate
     std::vector<triangle_intersect_result> tirs;
-    _intersect_all(r, _kdt.root.get(), tirs);
+    double t_min = 0.0, t_max = std::numeric_limits<double>::infinity();
+    if (!_kdt.empty() && _kdt.range.clip(r, t_min, t_max))
+    {
+        _intersect_all(r, 0, t_min, t_max, tirs);
+    }
     std::vector<bool> added(_tri.size());
     for (std::size_t i = 0; i < _tri.size(); ++i)
     {
@@ -109,17 +178,68 @@ std::vector<intersect_result> mesh_object::intersect_all(const ray &r) const
     return result;
 }
 
-mesh_object::triangle_intersect_result
-mesh_object::_intersect_triangle(const ray &r, std::size_t i) const
+ray_packet::mask_t mesh_object::intersect_packet(const ray_packet &rp, ray_packet::mask_t mask,
+                                                 intersect_result *closest) const
+{
+    if (!rp.coherent)
+    {
+        return object::intersect_packet(rp, mask, closest);
+    }
+
+    triangle_intersect_result closest_triangles[ray_packet::max_size]; // failed
+    ray_packet::interval interval;
+    ray_packet::mask_t active = 0;
+    for (ray_packet::mask_t m = mask; m; m &= m - 1)
+    {
+        const std::size_t i = ray_packet::lowest(m);
+        interval.t_min[i] = 0.0;
+        interval.t_max[i] = std::numeric_limits<double>::infinity();
+        if (!_kdt.empty() && _kdt.range.clip(rp[i], interval.t_min[i], interval.t_max[i]))
+        {
+            active |= (ray_packet::mask_t)1 << i;
+        }
+    }
+    if (!active)
+    {
+        return 0;
+    }
+    _intersect_packet(rp, 0, interval, active, closest_triangles);
+
+    ray_packet::mask_t replaced = 0;
+    for (std::size_t i = 0; i < rp.size; ++i)
+    {
+        const triangle_intersect_result &tir = closest_triangles[i];
+        if (tir.succeeded && (!closest[i].succeeded || tir.t < closest[i].distance))
+        {
+            const ray &r = rp[i];
+            closest[i] = intersect_result(r.origin + r.direction * tir.t, get_normal_vector(tir), tir.t,
+                                          tir.alpha, tir.beta, tir.index);
+            replaced |= (ray_packet::mask_t)1 << i;
+        }
+    }
+    return replaced;
+}
+
+std::size_t mesh_object::count_intersections(const ray &r, double t_min, double t_max,
+                                             std::size_t max_count) const
 {
-    const vector3di &tri = _tri[i];
-    const vector3df &a = _v[tri.x], &b = _v[tri.y], &c = _v[tri.z];
-    const triangle_cache &cache = _caches[i];
+    std::size_t count = 0;
+    if (max_count > 0 && !_kdt.empty() && _kdt.range.clip(r, t_min, t_max))
+    {
+        _count_intersections(r, 0, t_min, t_max, max_count, count);
+    }
+    return count;
+}
 
-    vector3df E1 = a - b;
-    vector3df E2 = a - c;
+mesh_object::triangle_intersect_result
+mesh_object::_intersect_triangle(const ray &r, std::size_t ref, std::size_t i) const
+{
+    // the arithmetic of the triangle_block kernels
+    const triangle_block::triangle &tri = _triangles[ref];
+    const vector3df &a = tri.a, &E1 = tri.E1, &E2 = tri.E2;
+    const vector3df E1xE2 = E1.cross(E2);
 
-    double divisor = cache.E1xE2.dot(r.direction);
+    double divisor = E1xE2.dot(r.direction);
     if (divisor <= eps && divisor >= -eps)
     {
         return triangle_intersect_result::failed;
@@ -127,7 +247,7 @@ mesh_object::_intersect_triangle(const ray &r, std::size_t i) const
     double divisor_inv = 1.0 / divisor;
 
     vector3df S = a - r.origin;
-    double t = cache.E1xE2.dot(S) * divisor_inv;
+    double t = E1xE2.dot(S) * divisor_inv;
     if (t <= eps)
     {
         return triangle_intersect_result::failed;
@@ -166,36 +286,313 @@ vector3df mesh_object::get_normal_vector(const triangle_intersect_result &tir) c
     }
 }
 
-void mesh_object::_intersect_all(const ray &r, kd_tree<triangle_index>::node *node,
+mesh_object::triangle_intersect_result mesh_object::_intersect(const ray &r) const
+{
+    struct stack_item
+    {
+        std::size_t node;
+        double t_min, t_max;
+    };
+
+    triangle_intersect_result closest = triangle_intersect_result::failed;
+    double t_min = 0.0, t_max = std::numeric_limits<double>::infinity();
+    if (_kdt.empty() || !_kdt.range.clip(r, t_min, t_max))
+    {
+        return closest;
+    }
+
+    // front-to-back traversal, far children wait on a fixed-size stack
+    stack_item stack[kd_tree<triangle_index>::max_depth + 1];
+    std::size_t stack_size = 0;
+    std::size_t node = 0;
+    while (true)
+    {
+        while (!_kdt.nodes[node].is_leaf())
+        {
+            std::size_t first, second;
+            double t_split;
+            if (_kdt.clip_children(node, r, t_min, t_max, first, second, t_split) == 2)
+            {
+                stack[stack_size++] = stack_item { second, t_split, t_max };
+                t_max = t_split;
+            }
+            node = first;
+        }
+
+        _intersect_leaf(r, node, closest);
+
+        // nothing behind this leaf can be closer
+        if (closest.succeeded && closest.t <= t_max)
+        {
+            return closest;
+        }
+
+        if (stack_size == 0)
+        {
+            return closest;
+        }
+        --stack_size;
+        node = stack[stack_size].node;
+        t_min = stack[stack_size].t_min;
+        t_max = stack[stack_size].t_max;
+    }
+}
+
+void mesh_object::_intersect_leaf(const ray &r, std::size_t node,
+                                  triangle_intersect_result &closest) const
+{
+    const kd_tree<triangle_index>::flat_node &n = _kdt.nodes[node];
+    const unsigned int *indices = _kdt.indices.data() + n.index,
+                       *refs = _triangle_refs.data() + n.index;
+    if (n.size() < triangle_block::min_count)
+    {
+        for (std::size_t i = 0; i < n.size(); ++i)
+        {
+            triangle_intersect_result tir = _intersect_triangle(r, refs[i], indices[i]);
+            if (tir.succeeded && (!closest.succeeded || tir.t < closest.t))
+            {
+                closest = tir;
+            }
+        }
+        return;
+    }
+    triangle_block::hits h;
+    for (std::size_t begin = 0; begin < n.size(); begin += triangle_block::size)
+    {
+        const std::size_t count = std::min<std::size_t>(n.size() - begin, triangle_block::size);
+        const unsigned int hit = triangle_block::intersect(_triangles.data(), refs + begin,
+                                                           count, r, h);
+        if (!hit)
+        {
+            continue;
+        }
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if ((hit >> i & 1) && (!closest.succeeded || h.t[i] < closest.t))
+            {
+                closest = triangle_intersect_result(indices[begin + i], h.t[i],
+                                                    1.0 - (h.beta[i] + h.gamma[i]),
+                                                    h.beta[i], h.gamma[i]);
+            }
+        }
+    }
+}
+
+void mesh_object::_intersect_all(const ray &r, std::size_t node, double t_min, double t_max,
                                  std::vector<triangle_intersect_result> &result) const
 {
-    if (!node || !node->range.intersect(r).succeeded)
+    const kd_tree<triangle_index>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
     {
+        std::size_t first, second;
+        double t_split;
+        if (_kdt.clip_children(node, r, t_min, t_max, first, second, t_split) == 2)
+        {
+            _intersect_all(r, first, t_min, t_split, result);
+            _intersect_all(r, second, t_split, t_max, result);
+        }
+        else
+        {
+            _intersect_all(r, first, t_min, t_max, result);
+        }
         return;
     }
-    if (node->left && node->right)
+
+    for (std::size_t i = n.index; i < n.index + n.size(); ++i)
     {
-        _intersect_all(r, node->left, result);
-        _intersect_all(r, node->right, result);
+        triangle_intersect_result tir = _intersect_triangle(r, _triangle_refs[i],
+                                                            _kdt.indices[i]);
+        if (!tir.succeeded)
+        {
+            continue;
+        }
+        result.push_back(tir);
     }
-    else if (node->left)
+}
+
+void mesh_object::_count_intersections(const ray &r, std::size_t node, double t_min, double t_max,
+                                       std::size_t max_count, std::size_t &count) const
+{
+    const kd_tree<triangle_index>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
     {
-        _intersect_all(r, node->left, result);
+        std::size_t first, second;
+        double t_split;
+        if (_kdt.clip_children(node, r, t_min, t_max, first, second, t_split) == 2)
+        {
+            _count_intersections(r, first, t_min, t_split, max_count, count);
+            if (count < max_count)
+            {
+                _count_intersections(r, second, t_split, t_max, max_count, count);
+            }
+        }
+        else
+        {
+            _count_intersections(r, first, t_min, t_max, max_count, count);
+        }
+        return;
     }
-    else if (node->right)
+
+    // a triangle may be in more than one leaf, but its hit point is only
+    // inside one leaf's interval
+    const unsigned int *refs = _triangle_refs.data() + n.index;
+    if (n.size() < triangle_block::min_count)
     {
-        _intersect_all(r, node->right, result);
+        for (std::size_t i = 0; i < n.size() && count < max_count; ++i)
+        {
+            triangle_intersect_result tir = _intersect_triangle(r, refs[i],
+                                                                _kdt.indices[n.index + i]);
+            if (tir.succeeded && t_min <= tir.t && tir.t < t_max)
+            {
+                ++count;
+            }
+        }
+        return;
     }
-    else
+    triangle_block::hits h;
+    for (std::size_t begin = 0; begin < n.size() && count < max_count;
+         begin += triangle_block::size)
     {
-        for (std::size_t i = 0; i < node->size; ++i)
+        const std::size_t block_size = std::min<std::size_t>(n.size() - begin,
+                                                             triangle_block::size);
+        const unsigned int hit = triangle_block::intersect(_triangles.data(), refs + begin,
+                                                           block_size, r, h);
+        for (std::size_t i = 0; i < block_size && count < max_count; ++i)
         {
-            triangle_intersect_result tir = _intersect_triangle(r, node->points[i]);
-            if (!tir.succeeded)
+            if ((hit >> i & 1) && t_min <= h.t[i] && h.t[i] < t_max)
             {
-                continue;
+                ++count;
             }
-            result.push_back(tir);
         }
     }
+}
+
+void mesh_object::_intersect_packet(const ray_packet &rp, std::size_t node,
+                                    const ray_packet::interval &interval, ray_packet::mask_t mask,
+                                    triangle_intersect_result *closest) const
+{
+    // as in _intersect, a ray is done once a node starts behind its closest hit
+    for (ray_packet::mask_t m = mask; m; m &= m - 1)
+    {
+        const std::size_t k = ray_packet::lowest(m);
+        if (closest[k].succeeded && interval.t_min[k] > closest[k].t)
+        {
+            mask &= ~((ray_packet::mask_t)1 << k);
+        }
+    }
+    if (!mask)
+    {
+        return;
+    }
+
+    const kd_tree<triangle_index>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
+    {
+        std::size_t first, second;
+        ray_packet::mask_t first_mask, second_mask;
+        ray_packet::interval first_interval, second_interval;
+        ray_packet::mask_t reversed =
+            _kdt.clip_children(node, rp, mask, interval, first, first_mask, first_interval,
+                               second, second_mask, second_interval);
+        if (first_mask)
+        {
+            _intersect_packet(rp, first, first_interval, first_mask, closest);
+        }
+        if (second_mask)
+        {
+            _intersect_packet(rp, second, second_interval, second_mask, closest);
+        }
+        if (reversed) // again, front to back for them
+        {
+            _intersect_packet(rp, node, interval, reversed, closest);
+        }
+        return;
+    }
+
+    for (ray_packet::mask_t m = mask; m; m &= m - 1)
+    {
+        const std::size_t k = ray_packet::lowest(m);
+        _intersect_leaf(rp[k], node, closest[k]);
+    }
+}
+
+bool triangle_index::get_clipped_aabb(const aa_cube &box, aa_cube &result) const
+{
+    // most triangles of a node are inside it, or cross one of its planes
+    const aa_cube aabb = get_aabb();
+    bool crosses[6];
+    bool clip = false;
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        const double lo = box.p.dim[dim], hi = lo + box.size.dim[dim];
+        if (aabb.p.dim[dim] > hi || aabb.p.dim[dim] + aabb.size.dim[dim] < lo)
+        {
+            return false;
+        }
+        crosses[2 * dim] = aabb.p.dim[dim] < lo;
+        crosses[2 * dim + 1] = aabb.p.dim[dim] + aabb.size.dim[dim] > hi;
+        clip = clip || crosses[2 * dim] || crosses[2 * dim + 1];
+    }
+    if (!clip)
+    {
+        result = aabb;
+        return true;
+    }
+
+    // Sutherland-Hodgman, one plane of box at a time. Every plane adds at
+    // most one vertex, so the polygon never has more than nine.
+    vector3df polygon[2][9];
+    std::size_t size = 3, current = 0;
+    for (std::size_t vertex = 0; vertex < 3; ++vertex)
+    {
+        polygon[0][vertex] = mo->_v[mo->_tri[i].dim[vertex]];
+    }
+    for (std::size_t plane = 0; plane < 6; ++plane)
+    {
+        if (!crosses[plane])
+        {
+            continue;
+        }
+        const std::size_t dim = plane / 2;
+        const bool upper = plane % 2 == 1;
+        const double position = box.p.dim[dim] + (upper ? box.size.dim[dim] : 0.0);
+        const vector3df *in = polygon[current];
+        vector3df *out = polygon[1 - current];
+        std::size_t out_size = 0;
+        for (std::size_t k = 0; k < size; ++k)
+        {
+            const vector3df &a = in[k], &b = in[(k + 1) % size];
+            // >= 0 inside
+            const double da = upper ? position - a.dim[dim] : a.dim[dim] - position,
+                         db = upper ? position - b.dim[dim] : b.dim[dim] - position;
+            if (da >= 0.0)
+            {
+                out[out_size++] = a;
+            }
+            if ((da >= 0.0) != (db >= 0.0))
+            {
+                vector3df p = a + (b - a) * (da / (da - db));
+                p.dim[dim] = position;
+                out[out_size++] = p;
+            }
+        }
+        if (out_size == 0)
+        {
+            return false;
+        }
+        size = out_size;
+        current = 1 - current;
+    }
+
+    vector3df min_v = polygon[current][0], max_v = min_v;
+    for (std::size_t k = 1; k < size; ++k)
+    {
+        for (std::size_t dim = 0; dim < 3; ++dim)
+        {
+            min_v.dim[dim] = std::min(min_v.dim[dim], polygon[current][k].dim[dim]);
+            max_v.dim[dim] = std::max(max_v.dim[dim], polygon[current][k].dim[dim]);
+        }
+    }
+    result = aa_cube(min_v, max_v - min_v);
+    return true;
 }
\ No newline at end of file
@@ -1,12 +1,15 @@
 #ifndef _MESH_OBJECT_H_
 #define _MESH_OBJECT_H_
 
+#include <thread>
+
 #include "object.h"
 #include "ray.h"
 #include "vector3d.hpp"
 #include "mesh.h"
 #include "aa_cube.h"
 #include "kd_tree.hpp"
+#include "triangle_block.h"
 
 class triangle_index;
 
@@ -16,7 +19,7 @@ class mesh_object
 private:
     struct triangle_cache
     {
-        vector3df E1xE2, n;
+        vector3df n; // flat, E1 x E2 is computed from _triangles when needed
     };
 
     class triangle_intersect_result
@@ -26,7 +29,7 @@ private:
         std::size_t index;
         double t, alpha, beta, gamma;
 
-        explicit triangle_intersect_result(bool succeeded) // Failed.
+        explicit triangle_intersect_result(bool succeeded = false) // Failed.
             : succeeded(succeeded)
         {
 
@@ -48,27 +51,69 @@ private:
     std::vector<vector3df> _n; // normal vectors of vertices
     std::vector<triangle_cache> _caches; // params caches for triangle surfaces
     kd_tree<triangle_index> _kdt;
+    std::vector<triangle_block::triangle> _triangles; // for all tests, in leaf order
+    std::vector<unsigned int> _triangle_refs; // _kdt.indices mapped into _triangles
 
 public:
     friend class triangle_index;
     bool smooth = true; // normal vector interpolation
 
-    mesh_object(const mesh &m);
+    // the SAH tree traces faster but takes longer to build, worth it when the
+    // tree is kept, see mesh_file::load_cached
+    mesh_object(const mesh &m, bool use_sah = false,
+                std::size_t thread_count = std::thread::hardware_concurrency());
+    // with a kd-tree built before for the same mesh, see tree()
+    mesh_object(const mesh &m, const kd_tree<triangle_index> &tree);
 
     intersect_result intersect(const ray &r) const override;
     std::vector<intersect_result> intersect_all(const ray &r) const override;
+    ray_packet::mask_t intersect_packet(const ray_packet &rp, ray_packet::mask_t mask,
+                                        intersect_result *closest) const override;
+    std::size_t count_intersections(const ray &r, double t_min, double t_max,
+                                    std::size_t max_count) const override;
+
+    bool bounded() const override
+    {
+        return true;
+    }
+
+    aa_cube get_aabb() const override
+    {
+        return _kdt.range;
+    }
 
     vector3df texture_uv(const intersect_result &ir) const
     {
         return _texture_uv(ir);
     }
 
+    const mesh &get_mesh() const
+    {
+        return _mesh;
+    }
+
+    const kd_tree<triangle_index> &tree() const
+    {
+        return _kdt;
+    }
+
 private:
-    triangle_intersect_result _intersect_triangle(const ray &r, std::size_t i) const;
+    void _init(); // triangle caches and vertex normals
+    void _print_statistics() const;
+    void _pack_triangles();
+    // triangle i of the mesh, _triangles[ref]
+    triangle_intersect_result _intersect_triangle(const ray &r, std::size_t ref,
+                                                  std::size_t i) const;
     vector3df get_normal_vector(const triangle_intersect_result &tir) const;
-    // unsigned int _intersect(const ray &r, kd_tree<triangle_index>::node *node) const;
-    void _intersect_all(const ray &r, kd_tree<triangle_index>::node *node,
+    triangle_intersect_result _intersect(const ray &r) const;
+    void _intersect_leaf(const ray &r, std::size_t node, triangle_intersect_result &closest) const;
+    void _intersect_all(const ray &r, std::size_t node, double t_min, double t_max,
                         std::vector<triangle_intersect_result> &result) const;
+    void _intersect_packet(const ray_packet &rp, std::size_t node,
+                           const ray_packet::interval &interval, ray_packet::mask_t mask,
+                           triangle_intersect_result *closest) const;
+    void _count_intersections(const ray &r, std::size_t node, double t_min, double t_max,
+                              std::size_t max_count, std::size_t &count) const;
 
     vector3df _texture_uv(const intersect_result &ir) const override
     {
@@ -134,6 +179,9 @@ public:
         }
         return aa_cube(min_v, max_v - min_v);
     }
+
+    // bounds of the part of the triangle inside box, false if there is none
+    bool get_clipped_aabb(const aa_cube &box, aa_cube &result) const;
 };
 
 #endif // _MESH_OBJECT_H_
\ No newline at end of file
@@ -1,4 +1,11 @@
 #include "object.h"
 
+#include "aa_cube.h"
+
 const intersect_result intersect_result::failed(false);
-object object::dummy;
\ No newline at end of file
+object object::dummy;
+
+aa_cube object::get_aabb() const
+{
+    return aa_cube(vector3df::zero, vector3df::zero); // unbounded
+}
\ No newline at end of file
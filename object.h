@@ -8,6 +8,8 @@
 #include "ray.h"
 #include "vector3d.hpp"
 
+class aa_cube;
+
 class intersect_result
 {
 public:
@@ -18,7 +20,7 @@ public:
     std::size_t index = 0; // (optional) index
     double u, v; // (optional) surface parameters
 
-    explicit intersect_result(bool succeeded) // Failed.
+    explicit intersect_result(bool succeeded = false) // Failed.
         : succeeded(succeeded)
     {
 
@@ -69,6 +71,51 @@ public:
         }
     }
 
+    // For the rays of rp selected by mask, replaces closest[i] with the hit
+    // of rp[i] if closest[i] failed or is further. Returns the rays replaced.
+    // Overridden where the rays can share work or misses are cheaper.
+    virtual ray_packet::mask_t intersect_packet(const ray_packet &rp, ray_packet::mask_t mask,
+                                                intersect_result *closest) const
+    {
+        ray_packet::mask_t replaced = 0;
+        for (std::size_t i = 0; i < rp.size; ++i)
+        {
+            if (mask >> i & 1)
+            {
+                intersect_result ir = intersect(rp[i]);
+                if (ir.succeeded && (!closest[i].succeeded || ir.distance < closest[i].distance))
+                {
+                    closest[i] = ir;
+                    replaced |= (ray_packet::mask_t)1 << i;
+                }
+            }
+        }
+        return replaced;
+    }
+
+    // Number of intersections with t_min <= distance < t_max, counting stops
+    // at max_count. Objects with more than one intersection override it along
+    // with intersect_all.
+    virtual std::size_t count_intersections(const ray &r, double t_min, double t_max,
+                                            std::size_t max_count) const
+    {
+        if (max_count == 0)
+        {
+            return 0;
+        }
+        intersect_result ir = intersect(r);
+        return ir.succeeded && t_min <= ir.distance && ir.distance < t_max ? 1 : 0;
+    }
+
+    // Planes and other infinite objects are unbounded.
+    virtual bool bounded() const
+    {
+        return false;
+    }
+
+    // Axis-aligned bounding box, only valid if bounded.
+    virtual aa_cube get_aabb() const;
+
     vector3df get_diffuse(const intersect_result &ir) const
     {
         if (!texture)
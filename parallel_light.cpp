@@ -1,20 +1,16 @@
 #include "parallel_light.h"
 
+#include <limits>
+
 #include "vector3d.hpp"
 #include "light.h"
 
 light_info parallel_light::illuminate(const vector3df &p) const
 {
-    std::vector<world_intersect_result> results = w.intersect_all(ray(p, -direction, 0, 0));
-    vector3df coeff = vector3df::one;
-    for (auto &ir : results)
+    vector3df coeff;
+    if (!w.transmittance(ray(p, -direction, 0, 0), std::numeric_limits<double>::infinity(), coeff))
     {
-        if (ir.obj.refractiveness.length2() <= eps2)
-        {
-            return light_info::dark;
-        }
-
-        coeff = coeff.modulate(ir.obj.refractiveness);
+        return light_info::dark;
     }
     return light_info(color.modulate(coeff), direction);
 }
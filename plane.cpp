@@ -23,4 +23,34 @@ intersect_result plane::intersect(const ray &r) const
     }
 
     return intersect_result(r.origin + r.direction * t, n, t);
+}
+
+ray_packet::mask_t plane::intersect_packet(const ray_packet &rp, ray_packet::mask_t mask,
+                                           intersect_result *closest) const
+{
+    ray_packet::mask_t replaced = 0;
+    for (std::size_t i = 0; i < rp.size; ++i)
+    {
+        if (!(mask >> i & 1))
+        {
+            continue;
+        }
+
+        const ray &r = rp[i];
+        double divisor = n.dot(r.direction);
+        if (divisor <= eps && divisor >= -eps)
+        {
+            continue;
+        }
+
+        double t = -(D + n.dot(r.origin)) / divisor;
+        if (t <= eps || (closest[i].succeeded && t >= closest[i].distance))
+        {
+            continue;
+        }
+
+        closest[i] = intersect_result(r.origin + r.direction * t, n, t);
+        replaced |= (ray_packet::mask_t)1 << i;
+    }
+    return replaced;
 }
\ No newline at end of file
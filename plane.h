@@ -19,6 +19,8 @@ public:
     }
 
     intersect_result intersect(const ray &r) const override;
+    ray_packet::mask_t intersect_packet(const ray_packet &rp, ray_packet::mask_t mask,
+                                        intersect_result *closest) const override;
 };
 
 #endif // _PLANE_H_
\ No newline at end of file
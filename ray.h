@@ -1,7 +1,7 @@
 #ifndef _RAY_H_
 #define _RAY_H_
 
-#include <stack>
+#include <cstddef>
 
 #include "vector3d.hpp"
 
@@ -12,8 +12,13 @@ public:
     double refractive_index; // origin refractive index
     int image_x, image_y;
 
+    // nesting depth of media remembered by a ray, entering one more drops
+    // the outermost, which is then left as if into air
+    static constexpr std::size_t max_media = 8;
+
 private:
-    std::stack<double> _refractive_index_history;
+    double _refractive_index_history[max_media]; // bottom to top
+    std::size_t _history_size = 0;
 
 public:
     // new ray
@@ -28,30 +33,36 @@ public:
     // for reflection
     ray(const ray &r, const vector3df &origin, const vector3df &direction)
         : origin(origin), direction(direction), refractive_index(r.refractive_index),
-          image_x(r.image_x), image_y(r.image_y),
-          _refractive_index_history(r._refractive_index_history) // copy
+          image_x(r.image_x), image_y(r.image_y)
     {
-
+        _copy_history(r);
     }
 
     // for refraction
     ray(const ray &r, const vector3df &origin, const vector3df &direction,
         bool in_out, double new_refractive_index = 1.0)
         : origin(origin), direction(direction),
-          image_x(r.image_x), image_y(r.image_y),
-          _refractive_index_history(r._refractive_index_history)
+          image_x(r.image_x), image_y(r.image_y)
     {
+        _copy_history(r);
         if (in_out == in) // in
         {
-            _refractive_index_history.push(r.refractive_index); // save old
+            if (_history_size == max_media) // full, forget the outermost
+            {
+                for (std::size_t i = 1; i < max_media; ++i)
+                {
+                    _refractive_index_history[i - 1] = _refractive_index_history[i];
+                }
+                --_history_size;
+            }
+            _refractive_index_history[_history_size++] = r.refractive_index; // save old
             refractive_index = new_refractive_index; // load new
         }
         else if (in_out == out) // out
         {
-            if (!_refractive_index_history.empty())
+            if (_history_size != 0)
             {
-                refractive_index = _refractive_index_history.top();
-                _refractive_index_history.pop();
+                refractive_index = _refractive_index_history[--_history_size];
             }
             else
             {
@@ -62,9 +73,9 @@ public:
     
     double last_refractive_index() const
     {
-        if (!_refractive_index_history.empty())
+        if (_history_size != 0)
         {
-            return _refractive_index_history.top();
+            return _refractive_index_history[_history_size - 1];
         }
         else
         {
@@ -73,6 +84,88 @@ public:
     }
 
     static constexpr bool in = true, out = false;
+
+private:
+    void _copy_history(const ray &r)
+    {
+        _history_size = r._history_size;
+        for (std::size_t i = 0; i < _history_size; ++i)
+        {
+            _refractive_index_history[i] = r._refractive_index_history[i];
+        }
+    }
+};
+
+// Up to max_size rays, usually primary rays through neighbouring pixels,
+// traversed together through the kd-trees. Every ray keeps its own interval,
+// the nodes are visited once for all rays that go through them in the same
+// order. A packet whose directions do not share one octant is not coherent
+// and is traced ray by ray.
+class ray_packet
+{
+public:
+    static constexpr std::size_t max_size = 16;
+    typedef unsigned int mask_t; // bit i selects the i-th ray
+
+    // per-ray [t_min, t_max] of a kd-tree node
+    struct interval
+    {
+        double t_min[max_size], t_max[max_size];
+    };
+
+private:
+    const ray *_rays[max_size];
+
+public:
+    std::size_t size = 0;
+    bool coherent = true;
+    // copies by axis, for the kd-tree traversal
+    double origin[3][max_size], direction[3][max_size];
+
+    void push_back(const ray &r)
+    {
+        for (std::size_t dim = 0; dim < 3; ++dim)
+        {
+            origin[dim][size] = r.origin.dim[dim];
+            direction[dim][size] = r.direction.dim[dim];
+            if (size != 0 && (r.direction.dim[dim] < 0.0) != (direction[dim][0] < 0.0))
+            {
+                coherent = false;
+            }
+        }
+        _rays[size++] = &r;
+    }
+
+    void clear()
+    {
+        size = 0;
+        coherent = true;
+    }
+
+    const ray &operator[](std::size_t i) const
+    {
+        return *_rays[i];
+    }
+
+    mask_t all() const
+    {
+        return ((mask_t)1 << size) - 1; // max_size is less than the bits of mask_t
+    }
+
+    // index of the first ray in m, which is not 0
+    static std::size_t lowest(mask_t m)
+    {
+#ifdef __GNUC__
+        return __builtin_ctz(m);
+#else
+        std::size_t i = 0;
+        while (!(m >> i & 1))
+        {
+            ++i;
+        }
+        return i;
+#endif
+    }
 };
 
 #endif // _RAY_H_
\ No newline at end of file
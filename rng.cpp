@@ -0,0 +1,24 @@
+#include "rng.h"
+
+#include <cstring>
+
+std::uint64_t mix_seed(std::uint64_t seed, std::uint64_t stream)
+{
+    std::uint64_t z = seed + (stream + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+std::uint64_t ray_seed(const ray &r, std::uint64_t seed)
+{
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &r.origin.dim[dim], sizeof(bits));
+        seed = mix_seed(seed, bits);
+        std::memcpy(&bits, &r.direction.dim[dim], sizeof(bits));
+        seed = mix_seed(seed, bits);
+    }
+    return seed;
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <cstdint>
+
+#include "ray.h"
+
+// Seeds for std::default_random_engine. Every thread gets its own engine
+// seeded from a user seed and a stream number, so that two runs with the
+// same seed and thread count produce the same numbers.
+
+// splitmix64, spreads seed and stream (e.g. pass, thread) over all bits
+std::uint64_t mix_seed(std::uint64_t seed, std::uint64_t stream);
+
+// counter-based, the same ray always gives the same seed
+std::uint64_t ray_seed(const ray &r, std::uint64_t seed);
+
+#endif // _RNG_H_
\ No newline at end of file
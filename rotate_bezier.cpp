@@ -1,8 +1,10 @@
 #include <cstddef>
 #include <cstdio>
+#include <algorithm>
 
 #include "rotate_bezier.h"
 
+#include "aa_cube.h"
 #include "object.h"
 #include "ray.h"
 #include "vector3d.hpp"
@@ -36,6 +38,21 @@ intersect_result rotate_bezier::intersect(const ray &r) const
     return curve_ir;
 }
 
+aa_cube rotate_bezier::get_aabb() const
+{
+    // convex hull property: the curve lies inside its control polygon,
+    // so the rotated surface lies inside the cylinder of radius max |x|
+    double max_x = 0.0, min_y = curve[0].y, max_y = curve[0].y;
+    for (const auto &v : curve.data)
+    {
+        max_x = std::max(max_x, std::abs(v.x));
+        min_y = std::min(min_y, v.y);
+        max_y = std::max(max_y, v.y);
+    }
+    return aa_cube(position + vector3df(-max_x, min_y, -max_x),
+                   vector3df(2.0 * max_x, max_y - min_y, 2.0 * max_x));
+}
+
 intersect_result rotate_bezier::intersect(const ray &r, double t0, double u0, double v0) const
 {
     //printf("init: t=%0.10lf, v=%0.10lf, u=%0.10lf, u/pi=%0.10lf\n", t0, v0, u0, u0 / M_PI);
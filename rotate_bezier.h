@@ -29,6 +29,13 @@ public:
     intersect_result intersect(const ray &r) const override;
     intersect_result intersect(const ray &r, double t0, double u0, double v0) const;
 
+    bool bounded() const override
+    {
+        return true;
+    }
+
+    aa_cube get_aabb() const override;
+
 private:
     vector3df _texture_uv(const intersect_result &ir) const override
     {
@@ -3,18 +3,19 @@
 
 #include "sphere.h"
 
+#include "aa_cube.h"
 #include "object.h"
 #include "ray.h"
 #include "vector3d.hpp"
 
-intersect_result sphere::intersect(const ray &r) const
+double sphere::_distance(const ray &r) const
 {
     vector3df l = c - r.origin;
     double tp = l.dot(r.direction);
     double d2 = l.length2() - tp * tp;
     if (d2 >= r2)
     {
-        return intersect_result::failed;
+        return -1.0;
     }
     double delta_t = sqrt(r2 - d2);
     double t;
@@ -41,15 +42,49 @@ intersect_result sphere::intersect(const ray &r) const
         }
         else
         {
-            return intersect_result::failed;
+            return -1.0;
         }
     }
 
+    return t;
+}
+
+intersect_result sphere::intersect(const ray &r) const
+{
+    double t = _distance(r);
     if (t <= eps)
     {
         return intersect_result::failed;
     }
+    return _result(r, t);
+}
 
+ray_packet::mask_t sphere::intersect_packet(const ray_packet &rp, ray_packet::mask_t mask,
+                                            intersect_result *closest) const
+{
+    // the normal, maybe bumped, only for the hits that are closer
+    ray_packet::mask_t replaced = 0;
+    for (std::size_t i = 0; i < rp.size; ++i)
+    {
+        if (!(mask >> i & 1))
+        {
+            continue;
+        }
+
+        double t = _distance(rp[i]);
+        if (t <= eps || (closest[i].succeeded && t >= closest[i].distance))
+        {
+            continue;
+        }
+
+        closest[i] = _result(rp[i], t);
+        replaced |= (ray_packet::mask_t)1 << i;
+    }
+    return replaced;
+}
+
+intersect_result sphere::_result(const ray &r, double t) const
+{
     vector3df p = r.origin + r.direction * t;
     intersect_result ir(p, (p - c) / this->r, t);
     ir.n = _get_normal(ir);
@@ -81,6 +116,35 @@ std::vector<intersect_result> sphere::intersect_all(const ray &r) const
     return results;
 }
 
+std::size_t sphere::count_intersections(const ray &r, double t_min, double t_max,
+                                        std::size_t max_count) const
+{
+    vector3df r_c = r.origin - c;
+    double B = r.direction.dot(r_c), C = r_c.length2() - r2; // t^2 + 2Bt + C = 0
+    double delta2 = B * B - C;
+    if (delta2 <= eps2)
+    {
+        return 0;
+    }
+    double delta = sqrt(delta2);
+    double t1 = -B - delta, t2 = -B + delta;
+    std::size_t count = 0;
+    if (t1 > eps && t_min <= t1 && t1 < t_max)
+    {
+        ++count;
+    }
+    if (t2 > eps && t_min <= t2 && t2 < t_max)
+    {
+        ++count;
+    }
+    return count < max_count ? count : max_count;
+}
+
+aa_cube sphere::get_aabb() const
+{
+    return aa_cube(c - vector3df::one * r, vector3df::one * (2.0 * r));
+}
+
 vector3df sphere::_get_normal(const intersect_result &ir) const
 {
     if (!bump_texture)
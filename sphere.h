@@ -20,9 +20,23 @@ public:
     }
 
     intersect_result intersect(const ray &r) const override;
+    ray_packet::mask_t intersect_packet(const ray_packet &rp, ray_packet::mask_t mask,
+                                        intersect_result *closest) const override;
     std::vector<intersect_result> intersect_all(const ray &r) const override;
+    std::size_t count_intersections(const ray &r, double t_min, double t_max,
+                                    std::size_t max_count) const override;
+
+    bool bounded() const override
+    {
+        return true;
+    }
+
+    aa_cube get_aabb() const override;
 
 private:
+    // distance to the hit of intersect, not greater than eps if it fails
+    double _distance(const ray &r) const;
+    intersect_result _result(const ray &r, double t) const;
     vector3df _get_normal(const intersect_result &ir) const;
     double _get_bump_texture(const vector3df &uv) const;
 
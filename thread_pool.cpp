@@ -0,0 +1,139 @@
+#include "thread_pool.h"
+
+#include <atomic>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+thread_pool::thread_pool(std::size_t thread_count, bool pin_threads)
+{
+    resize(thread_count, pin_threads);
+}
+
+thread_pool::~thread_pool()
+{
+    _stop_threads();
+}
+
+void thread_pool::resize(std::size_t thread_count, bool pin_threads)
+{
+    _stop_threads();
+    if (thread_count == 0)
+    {
+        thread_count = 1;
+    }
+    _stop = false;
+    _pinned = pin_threads;
+    for (std::size_t i = 0; i < thread_count - 1; ++i)
+    {
+        _threads.push_back(std::make_shared<std::thread>(&thread_pool::_worker, this, i,
+                                                         _generation));
+    }
+}
+
+void thread_pool::run(const std::function<void(std::size_t)> &task)
+{
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _job = &task;
+        _pending = _threads.size();
+        ++_generation;
+    }
+    _job_ready.notify_all();
+
+    task(_threads.size());
+
+    std::unique_lock<std::mutex> lock(_lock);
+    _job_done.wait(lock, [this] { return _pending == 0; });
+    _job = nullptr;
+}
+
+void thread_pool::parallel_for(std::size_t count, std::size_t chunk_size,
+                               const std::function<void(std::size_t, std::size_t,
+                                                        std::size_t)> &task)
+{
+    if (chunk_size == 0)
+    {
+        chunk_size = 1;
+    }
+    std::atomic<std::size_t> next(0);
+    run([&] (std::size_t thread_id)
+    {
+        for (;;)
+        {
+            std::size_t begin = next.fetch_add(chunk_size);
+            if (begin >= count)
+            {
+                break;
+            }
+            std::size_t end = begin + chunk_size < count ? begin + chunk_size : count;
+            task(begin, end, thread_id);
+        }
+    });
+}
+
+void thread_pool::_stop_threads()
+{
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _stop = true;
+    }
+    _job_ready.notify_all();
+    for (auto &t : _threads)
+    {
+        t->join();
+    }
+    _threads.clear();
+}
+
+void thread_pool::_worker(std::size_t thread_id, std::size_t generation)
+{
+    if (_pinned)
+    {
+        _pin_current(thread_id);
+    }
+    for (;;)
+    {
+        const std::function<void(std::size_t)> *job;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _job_ready.wait(lock, [&] { return _stop || _generation != generation; });
+            if (_stop)
+            {
+                return;
+            }
+            generation = _generation;
+            job = _job;
+        }
+
+        (*job)(thread_id);
+
+        bool last;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            last = --_pending == 0;
+        }
+        if (last)
+        {
+            _job_done.notify_one();
+        }
+    }
+}
+
+void thread_pool::_pin_current(std::size_t cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % CPU_SETSIZE, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % 64));
+#endif
+}
\ No newline at end of file
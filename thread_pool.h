@@ -0,0 +1,61 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads. The calling thread takes part in every job as
+// the last thread, so a pool of size n keeps n - 1 threads alive.
+class thread_pool
+{
+private:
+    std::vector<std::shared_ptr<std::thread> > _threads;
+    std::mutex _lock;
+    std::condition_variable _job_ready, _job_done;
+    const std::function<void(std::size_t)> *_job = nullptr;
+    std::size_t _generation = 0, _pending = 0;
+    bool _stop = false;
+    bool _pinned = false;
+
+public:
+    explicit thread_pool(std::size_t thread_count = 1, bool pin_threads = false);
+    ~thread_pool();
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    std::size_t size() const
+    {
+        return _threads.size() + 1;
+    }
+
+    bool pinned() const
+    {
+        return _pinned;
+    }
+
+    // stops the workers and starts thread_count - 1 new ones,
+    // pin_threads binds worker i to CPU i (Linux and Windows only). The
+    // calling thread is left as it is, it has a life outside the pool.
+    void resize(std::size_t thread_count, bool pin_threads = false);
+
+    // task(thread_id) on every thread, returns when all have finished
+    void run(const std::function<void(std::size_t)> &task);
+
+    // [0, count) in chunks of chunk_size, handed out in order to whichever
+    // thread is free: task(begin, end, thread_id)
+    void parallel_for(std::size_t count, std::size_t chunk_size,
+                      const std::function<void(std::size_t, std::size_t, std::size_t)> &task);
+
+private:
+    void _stop_threads();
+    void _worker(std::size_t thread_id, std::size_t generation);
+    static void _pin_current(std::size_t cpu);
+};
+
+#endif // _THREAD_POOL_H_
\ No newline at end of file
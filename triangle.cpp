@@ -1,8 +1,10 @@
 #include <cstddef>
 #include <cstdio>
+#include <algorithm>
 
 #include "triangle.h"
 
+#include "aa_cube.h"
 #include "object.h"
 #include "ray.h"
 #include "vector3d.hpp"
@@ -38,4 +40,15 @@ intersect_result triangle::intersect(const ray &r) const
 
     return intersect_result(r.origin + r.direction * t, n, t,
                             1.0 - (beta + gamma), beta);
+}
+
+aa_cube triangle::get_aabb() const
+{
+    vector3df min_v = a, max_v = a;
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        min_v.dim[dim] = std::min(min_v.dim[dim], std::min(b.dim[dim], c.dim[dim]));
+        max_v.dim[dim] = std::max(max_v.dim[dim], std::max(b.dim[dim], c.dim[dim]));
+    }
+    return aa_cube(min_v, max_v - min_v);
 }
\ No newline at end of file
@@ -23,6 +23,13 @@ public:
 
     intersect_result intersect(const ray &r) const override;
 
+    bool bounded() const override
+    {
+        return true;
+    }
+
+    aa_cube get_aabb() const override;
+
     void bind_texture(const vector3df &vta, const vector3df &vtb, const vector3df &vtc)
     {
         this->vta = vta;
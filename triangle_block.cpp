@@ -0,0 +1,223 @@
+#include "triangle_block.h"
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRIANGLE_BLOCK_X86
+#include <immintrin.h>
+#endif
+
+static unsigned int intersect_scalar(const triangle_block::triangle *triangles,
+                                     const unsigned int *indices, std::size_t count,
+                                     const ray &r, triangle_block::hits &h)
+{
+    const vector3df &o = r.origin, &d = r.direction;
+    unsigned int result = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const vector3df &a = triangles[indices[i]].a, &E1 = triangles[indices[i]].E1,
+                        &E2 = triangles[indices[i]].E2;
+        // E1 x E2
+        double nx = E1.y * E2.z - E2.y * E1.z,
+               ny = E1.z * E2.x - E2.z * E1.x,
+               nz = E1.x * E2.y - E2.x * E1.y;
+        double divisor = nx * d.x + ny * d.y + nz * d.z;
+        if (divisor <= eps && divisor >= -eps)
+        {
+            continue;
+        }
+        double divisor_inv = 1.0 / divisor;
+
+        double Sx = a.x - o.x, Sy = a.y - o.y, Sz = a.z - o.z;
+        double t = (nx * Sx + ny * Sy + nz * Sz) * divisor_inv;
+        if (t <= eps)
+        {
+            continue;
+        }
+        double DxSx = d.y * Sz - Sy * d.z,
+               DxSy = d.z * Sx - Sz * d.x,
+               DxSz = d.x * Sy - Sx * d.y;
+        double beta = (DxSx * E2.x + DxSy * E2.y + DxSz * E2.z) * divisor_inv;
+        if (beta <= eps || beta > 1.0)
+        {
+            continue;
+        }
+        // = DxS . -E1 * divisor_inv, the negations are exact
+        double gamma = (DxSx * E1.x + DxSy * E1.y + DxSz * E1.z) * -divisor_inv;
+        if (gamma <= eps || (beta + gamma) > 1.0)
+        {
+            continue;
+        }
+
+        h.t[i] = t;
+        h.beta[i] = beta;
+        h.gamma[i] = gamma;
+        result |= 1u << i;
+    }
+    return result;
+}
+
+#ifdef TRIANGLE_BLOCK_X86
+
+// The comparisons are the negations of the ones in intersect_scalar
+// (NLE for "not <=", NGT for "not >"), so that NaNs go the same way.
+// Lanes past count repeat the first triangle and are masked out.
+
+__attribute__((target("sse2")))
+static unsigned int intersect_sse2(const triangle_block::triangle *triangles,
+                                   const unsigned int *indices, std::size_t count,
+                                   const ray &r, triangle_block::hits &h)
+{
+    const __m128d ox = _mm_set1_pd(r.origin.x), oy = _mm_set1_pd(r.origin.y),
+                  oz = _mm_set1_pd(r.origin.z);
+    const __m128d dx = _mm_set1_pd(r.direction.x), dy = _mm_set1_pd(r.direction.y),
+                  dz = _mm_set1_pd(r.direction.z);
+    const __m128d eps_v = _mm_set1_pd(eps), minus_eps_v = _mm_set1_pd(-eps),
+                  one = _mm_set1_pd(1.0);
+
+    unsigned int result = 0;
+    for (std::size_t i = 0; i < count; i += 2)
+    {
+        const triangle_block::triangle &t0 = triangles[indices[i]],
+                                       &t1 = triangles[indices[i + 1 < count ? i + 1 : i]];
+        const __m128d E1x = _mm_set_pd(t1.E1.x, t0.E1.x), E1y = _mm_set_pd(t1.E1.y, t0.E1.y),
+                      E1z = _mm_set_pd(t1.E1.z, t0.E1.z);
+        const __m128d E2x = _mm_set_pd(t1.E2.x, t0.E2.x), E2y = _mm_set_pd(t1.E2.y, t0.E2.y),
+                      E2z = _mm_set_pd(t1.E2.z, t0.E2.z);
+        const __m128d nx = _mm_sub_pd(_mm_mul_pd(E1y, E2z), _mm_mul_pd(E2y, E1z)),
+                      ny = _mm_sub_pd(_mm_mul_pd(E1z, E2x), _mm_mul_pd(E2z, E1x)),
+                      nz = _mm_sub_pd(_mm_mul_pd(E1x, E2y), _mm_mul_pd(E2x, E1y));
+        __m128d divisor = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, dx), _mm_mul_pd(ny, dy)),
+                                     _mm_mul_pd(nz, dz));
+        __m128d ok = _mm_or_pd(_mm_cmpnle_pd(divisor, eps_v), _mm_cmpnge_pd(divisor, minus_eps_v));
+        __m128d divisor_inv = _mm_div_pd(one, divisor);
+
+        __m128d Sx = _mm_sub_pd(_mm_set_pd(t1.a.x, t0.a.x), ox),
+                Sy = _mm_sub_pd(_mm_set_pd(t1.a.y, t0.a.y), oy),
+                Sz = _mm_sub_pd(_mm_set_pd(t1.a.z, t0.a.z), oz);
+        __m128d t = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, Sx), _mm_mul_pd(ny, Sy)),
+                                          _mm_mul_pd(nz, Sz)), divisor_inv);
+        ok = _mm_and_pd(ok, _mm_cmpnle_pd(t, eps_v));
+
+        __m128d DxSx = _mm_sub_pd(_mm_mul_pd(dy, Sz), _mm_mul_pd(Sy, dz)),
+                DxSy = _mm_sub_pd(_mm_mul_pd(dz, Sx), _mm_mul_pd(Sz, dx)),
+                DxSz = _mm_sub_pd(_mm_mul_pd(dx, Sy), _mm_mul_pd(Sx, dy));
+        __m128d beta = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(DxSx, E2x), _mm_mul_pd(DxSy, E2y)),
+                                             _mm_mul_pd(DxSz, E2z)), divisor_inv);
+        ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpnle_pd(beta, eps_v), _mm_cmpngt_pd(beta, one)));
+        __m128d gamma = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(DxSx, E1x), _mm_mul_pd(DxSy, E1y)),
+                                              _mm_mul_pd(DxSz, E1z)),
+                                   _mm_sub_pd(_mm_setzero_pd(), divisor_inv));
+        ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpnle_pd(gamma, eps_v),
+                                       _mm_cmpngt_pd(_mm_add_pd(beta, gamma), one)));
+
+        _mm_storeu_pd(h.t + i, t);
+        _mm_storeu_pd(h.beta + i, beta);
+        _mm_storeu_pd(h.gamma + i, gamma);
+        result |= (unsigned int)_mm_movemask_pd(ok) << i;
+    }
+    return result & ((1u << count) - 1);
+}
+
+__attribute__((target("avx")))
+static unsigned int intersect_avx(const triangle_block::triangle *triangles,
+                                  const unsigned int *indices, std::size_t count,
+                                  const ray &r, triangle_block::hits &h)
+{
+    const __m256d ox = _mm256_set1_pd(r.origin.x), oy = _mm256_set1_pd(r.origin.y),
+                  oz = _mm256_set1_pd(r.origin.z);
+    const __m256d dx = _mm256_set1_pd(r.direction.x), dy = _mm256_set1_pd(r.direction.y),
+                  dz = _mm256_set1_pd(r.direction.z);
+    const __m256d eps_v = _mm256_set1_pd(eps), minus_eps_v = _mm256_set1_pd(-eps),
+                  one = _mm256_set1_pd(1.0);
+
+    // a triangle is nine doubles: rows of four from every triangle,
+    // transposed into a.x, a.y, a.z, E1.x and E1.y, E1.z, E2.x, E2.y
+    const double *p[4];
+    for (std::size_t i = 0; i < 4; ++i)
+    {
+        p[i] = &triangles[indices[i < count ? i : 0]].a.x;
+    }
+    __m256d c[8];
+    for (std::size_t row = 0; row < 2; ++row)
+    {
+        const __m256d r0 = _mm256_loadu_pd(p[0] + 4 * row), r1 = _mm256_loadu_pd(p[1] + 4 * row),
+                      r2 = _mm256_loadu_pd(p[2] + 4 * row), r3 = _mm256_loadu_pd(p[3] + 4 * row);
+        const __m256d l01 = _mm256_unpacklo_pd(r0, r1), h01 = _mm256_unpackhi_pd(r0, r1),
+                      l23 = _mm256_unpacklo_pd(r2, r3), h23 = _mm256_unpackhi_pd(r2, r3);
+        c[4 * row] = _mm256_permute2f128_pd(l01, l23, 0x20);
+        c[4 * row + 1] = _mm256_permute2f128_pd(h01, h23, 0x20);
+        c[4 * row + 2] = _mm256_permute2f128_pd(l01, l23, 0x31);
+        c[4 * row + 3] = _mm256_permute2f128_pd(h01, h23, 0x31);
+    }
+    const __m256d E1x = c[3], E1y = c[4], E1z = c[5];
+    const __m256d E2x = c[6], E2y = c[7], E2z = _mm256_set_pd(p[3][8], p[2][8], p[1][8], p[0][8]);
+    const __m256d nx = _mm256_sub_pd(_mm256_mul_pd(E1y, E2z), _mm256_mul_pd(E2y, E1z)),
+                  ny = _mm256_sub_pd(_mm256_mul_pd(E1z, E2x), _mm256_mul_pd(E2z, E1x)),
+                  nz = _mm256_sub_pd(_mm256_mul_pd(E1x, E2y), _mm256_mul_pd(E2x, E1y));
+    __m256d divisor = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, dx), _mm256_mul_pd(ny, dy)),
+                                    _mm256_mul_pd(nz, dz));
+    __m256d ok = _mm256_or_pd(_mm256_cmp_pd(divisor, eps_v, _CMP_NLE_UQ),
+                              _mm256_cmp_pd(divisor, minus_eps_v, _CMP_NGE_UQ));
+    __m256d divisor_inv = _mm256_div_pd(one, divisor);
+
+    __m256d Sx = _mm256_sub_pd(c[0], ox), Sy = _mm256_sub_pd(c[1], oy),
+            Sz = _mm256_sub_pd(c[2], oz);
+    __m256d t = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, Sx),
+                                                          _mm256_mul_pd(ny, Sy)),
+                                            _mm256_mul_pd(nz, Sz)), divisor_inv);
+    ok = _mm256_and_pd(ok, _mm256_cmp_pd(t, eps_v, _CMP_NLE_UQ));
+
+    __m256d DxSx = _mm256_sub_pd(_mm256_mul_pd(dy, Sz), _mm256_mul_pd(Sy, dz)),
+            DxSy = _mm256_sub_pd(_mm256_mul_pd(dz, Sx), _mm256_mul_pd(Sz, dx)),
+            DxSz = _mm256_sub_pd(_mm256_mul_pd(dx, Sy), _mm256_mul_pd(Sx, dy));
+    __m256d beta = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(DxSx, E2x),
+                                                             _mm256_mul_pd(DxSy, E2y)),
+                                               _mm256_mul_pd(DxSz, E2z)), divisor_inv);
+    ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(beta, eps_v, _CMP_NLE_UQ),
+                                         _mm256_cmp_pd(beta, one, _CMP_NGT_UQ)));
+    __m256d gamma = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(DxSx, E1x),
+                                                              _mm256_mul_pd(DxSy, E1y)),
+                                                _mm256_mul_pd(DxSz, E1z)),
+                                  _mm256_sub_pd(_mm256_setzero_pd(), divisor_inv));
+    ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(gamma, eps_v, _CMP_NLE_UQ),
+                                         _mm256_cmp_pd(_mm256_add_pd(beta, gamma), one, _CMP_NGT_UQ)));
+
+    _mm256_storeu_pd(h.t, t);
+    _mm256_storeu_pd(h.beta, beta);
+    _mm256_storeu_pd(h.gamma, gamma);
+    return (unsigned int)_mm256_movemask_pd(ok) & ((1u << count) - 1);
+}
+
+#endif // TRIANGLE_BLOCK_X86
+
+triangle_block::kernel triangle_block::_select_kernel()
+{
+#ifdef TRIANGLE_BLOCK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+    {
+        return intersect_avx;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return intersect_sse2;
+    }
+#endif
+    return intersect_scalar;
+}
+
+const triangle_block::kernel triangle_block::_kernel = triangle_block::_select_kernel();
+
+const char *triangle_block::kernel_name()
+{
+#ifdef TRIANGLE_BLOCK_X86
+    if (_kernel == intersect_avx)
+    {
+        return "AVX";
+    }
+    if (_kernel == intersect_sse2)
+    {
+        return "SSE2";
+    }
+#endif
+    return "scalar";
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef _TRIANGLE_BLOCK_H_
+#define _TRIANGLE_BLOCK_H_
+
+#include <cstddef>
+
+#include "ray.h"
+#include "vector3d.hpp"
+
+// Tests one ray against up to size triangles of a kd-tree leaf at once.
+// The triangles are kept once per mesh, in an array indexed like the
+// leaves, and gathered into lanes by coordinate for every test.
+// The kernel is chosen at startup: AVX, SSE2 or plain C++. All of them do
+// the arithmetic of mesh_object::_intersect_triangle in the same order, so
+// the results do not depend on the kernel.
+class triangle_block
+{
+public:
+    static constexpr std::size_t size = 4;
+    // smaller leaves are tested one triangle at a time
+    static constexpr std::size_t min_count = 2;
+
+    // a, E1 = a - b and E2 = a - c. E1 x E2 is computed by the kernels,
+    // which is cheaper than loading it.
+    struct triangle
+    {
+        vector3df a, E1, E2;
+    };
+
+    struct hits
+    {
+        double t[size], beta[size], gamma[size];
+    };
+
+    // Bit i is set if the ray hits triangles[indices[i]], i < count <= size,
+    // whose t, beta and gamma are then in h.
+    static unsigned int intersect(const triangle *triangles, const unsigned int *indices,
+                                  std::size_t count, const ray &r, hits &h)
+    {
+        return _kernel(triangles, indices, count, r, h);
+    }
+
+    static const char *kernel_name();
+
+private:
+    typedef unsigned int (*kernel)(const triangle *triangles, const unsigned int *indices,
+                                   std::size_t count, const ray &r, hits &h);
+
+    static const kernel _kernel;
+
+    static kernel _select_kernel();
+};
+
+#endif // _TRIANGLE_BLOCK_H_
\ No newline at end of file
@@ -222,5 +222,6 @@ const vector3d<T> vector3d<T>::back(T(0), T(0), T(1));
 
 typedef vector3d<std::ptrdiff_t> vector3di;
 typedef vector3d<double> vector3df;
+typedef vector3d<float> vector3ds; // single precision, for storage
 
 #endif // _VECTOR3D_H_
\ No newline at end of file
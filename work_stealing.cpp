@@ -0,0 +1,41 @@
+#include "work_stealing.h"
+
+work_stealing_queue::work_stealing_queue(std::size_t task_count, std::size_t thread_count)
+{
+    if (thread_count == 0)
+    {
+        thread_count = 1;
+    }
+    for (std::size_t i = 0; i < thread_count; ++i)
+    {
+        std::unique_ptr<share> s(new share);
+        s->begin = task_count * i / thread_count;
+        s->end = task_count * (i + 1) / thread_count;
+        _shares.push_back(std::move(s));
+    }
+}
+
+bool work_stealing_queue::next(std::size_t thread_id, std::size_t &task)
+{
+    {
+        share &own = *_shares[thread_id];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (own.begin < own.end)
+        {
+            task = own.begin++;
+            return true;
+        }
+    }
+    // steal, starting from the neighbour
+    for (std::size_t i = 1; i < _shares.size(); ++i)
+    {
+        share &victim = *_shares[(thread_id + i) % _shares.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (victim.begin < victim.end)
+        {
+            task = --victim.end;
+            return true;
+        }
+    }
+    return false;
+}
\ No newline at end of file
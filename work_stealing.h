@@ -0,0 +1,30 @@
+#ifndef _WORK_STEALING_H_
+#define _WORK_STEALING_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hands out tasks 0 .. task_count - 1 to thread_count threads. Every thread
+// starts with a contiguous share, takes tasks from the front of it and, when
+// it runs dry, steals from the back of another thread's share.
+class work_stealing_queue
+{
+private:
+    struct share
+    {
+        std::mutex lock;
+        std::size_t begin, end;
+    };
+
+    std::vector<std::unique_ptr<share> > _shares;
+
+public:
+    work_stealing_queue(std::size_t task_count, std::size_t thread_count);
+
+    // false when no task is left
+    bool next(std::size_t thread_id, std::size_t &task);
+};
+
+#endif // _WORK_STEALING_H_
\ No newline at end of file
@@ -1,19 +1,142 @@
 #include <vector>
 #include <memory>
+#include <cstdio>
+#include <limits>
+#include <algorithm>
+#include <cstring>
 
 #include "world.h"
+#include "rng.h"
 
 const world_intersect_result world_intersect_result::failed(false);
 
+static inline void _update_closest(object &obj, const intersect_result &ir,
+                                   object *&closest_obj, intersect_result &closest_result)
+{
+    if (ir.succeeded)
+    {
+        if (!closest_obj || (closest_obj && ir.distance < closest_result.distance))
+        {
+            closest_obj = &obj;
+            closest_result = ir;
+        }
+    }
+}
+
+// the packet version, the results are already replaced
+static inline void _update_closest(object &obj, ray_packet::mask_t replaced, object **closest_objs)
+{
+    for (std::size_t i = 0; replaced >> i; ++i)
+    {
+        if (replaced >> i & 1)
+        {
+            closest_objs[i] = &obj;
+        }
+    }
+}
+
+void world::build()
+{
+    std::vector<object_index> kd_points;
+    _unbounded.clear();
+    for (auto &o_ptr : _objects)
+    {
+        if (o_ptr->bounded())
+        {
+            kd_points.push_back(object_index(*o_ptr));
+        }
+        else
+        {
+            _unbounded.push_back(o_ptr.get());
+        }
+    }
+
+    if (kd_points.size() > 0)
+    {
+        printf("Building kd-tree (objects)...\n");
+        _kdt = kd_tree<object_index>::build(kd_points.begin(), kd_points.end(), true);
+    }
+    else
+    {
+        _kdt = kd_tree<object_index>();
+    }
+    _built = true;
+}
+
+static inline std::uint64_t _mix(std::uint64_t hash, const vector3df &v)
+{
+    for (std::size_t dim = 0; dim < 3; ++dim)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &v.dim[dim], sizeof(bits));
+        hash = mix_seed(hash, bits);
+    }
+    return hash;
+}
+
+std::uint64_t world::fingerprint() const
+{
+    std::uint64_t hash = mix_seed(source_hash, _objects.size());
+    for (const auto &o_ptr : _objects)
+    {
+        const object &o = *o_ptr;
+        if (o.bounded())
+        {
+            const aa_cube box = o.get_aabb();
+            hash = _mix(_mix(hash, box.p), box.size);
+        }
+        hash = _mix(_mix(_mix(hash, o.diffuse), o.emission), o.specular);
+        hash = _mix(_mix(hash, o.refractiveness),
+                    vector3df(o.shininess, o.reflectiveness, o.refractive_index));
+    }
+    hash = mix_seed(hash, lights.size());
+    for (const auto &l_ptr : lights)
+    {
+        hash = _mix(hash, l_ptr->flux());
+    }
+    return hash;
+}
+
 std::vector<world_intersect_result> world::intersect_all(const ray &r)
 {
     std::vector<world_intersect_result> results;
-    for (auto &o_ptr : _objects)
+    if (!_built)
     {
-        std::vector<intersect_result> obj_results = o_ptr->intersect_all(r);
+        for (auto &o_ptr : _objects)
+        {
+            std::vector<intersect_result> obj_results = o_ptr->intersect_all(r);
+            for (auto &ir : obj_results)
+            {
+                results.push_back(world_intersect_result(*o_ptr, ir));
+            }
+        }
+        return results;
+    }
+
+    for (object *o : _unbounded)
+    {
+        std::vector<intersect_result> obj_results = o->intersect_all(r);
         for (auto &ir : obj_results)
         {
-            results.push_back(world_intersect_result(*o_ptr, ir));
+            results.push_back(world_intersect_result(*o, ir));
+        }
+    }
+
+    // deduplicate, objects may be in more than one leaf
+    std::vector<object *> candidates;
+    double t_min = 0.0, t_max = std::numeric_limits<double>::infinity();
+    if (!_kdt.empty() && _kdt.range.clip(r, t_min, t_max))
+    {
+        _intersect_all(r, 0, t_min, t_max, candidates);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    for (object *o : candidates)
+    {
+        std::vector<intersect_result> obj_results = o->intersect_all(r);
+        for (auto &ir : obj_results)
+        {
+            results.push_back(world_intersect_result(*o, ir));
         }
     }
     return results;
@@ -24,16 +147,23 @@ world_intersect_result world::intersect(const ray &r)
     object *closest_obj = nullptr;
     intersect_result closest_result = intersect_result::failed;
 
-    for (auto &o_ptr : _objects)
+    if (!_built)
     {
-        intersect_result ir = o_ptr->intersect(r);
-        if (ir.succeeded)
+        for (auto &o_ptr : _objects)
         {
-            if (!closest_obj || (closest_obj && ir.distance < closest_result.distance))
-            {
-                closest_obj = o_ptr.get();
-                closest_result = ir;
-            }
+            _update_closest(*o_ptr, o_ptr->intersect(r), closest_obj, closest_result);
+        }
+    }
+    else
+    {
+        for (object *o : _unbounded)
+        {
+            _update_closest(*o, o->intersect(r), closest_obj, closest_result);
+        }
+        double t_min = 0.0, t_max = std::numeric_limits<double>::infinity();
+        if (!_kdt.empty() && _kdt.range.clip(r, t_min, t_max))
+        {
+            _intersect(r, 0, t_min, t_max, closest_obj, closest_result);
         }
     }
 
@@ -45,4 +175,240 @@ world_intersect_result world::intersect(const ray &r)
     {
         return world_intersect_result::failed;
     }
+}
+
+void world::intersect_packet(const ray_packet &rp, object **closest_objs,
+                             intersect_result *closest_results)
+{
+    for (std::size_t i = 0; i < rp.size; ++i)
+    {
+        closest_objs[i] = nullptr;
+        closest_results[i] = intersect_result::failed;
+    }
+
+    if (!_built || !rp.coherent)
+    {
+        for (std::size_t i = 0; i < rp.size; ++i)
+        {
+            world_intersect_result ir = intersect(rp[i]);
+            if (ir.succeeded)
+            {
+                closest_objs[i] = &ir.obj;
+                closest_results[i] = ir.result;
+            }
+        }
+        return;
+    }
+
+    for (object *o : _unbounded)
+    {
+        _update_closest(*o, o->intersect_packet(rp, rp.all(), closest_results), closest_objs);
+    }
+
+    if (_kdt.empty())
+    {
+        return;
+    }
+    ray_packet::interval interval;
+    ray_packet::mask_t mask = 0;
+    for (std::size_t i = 0; i < rp.size; ++i)
+    {
+        interval.t_min[i] = 0.0;
+        interval.t_max[i] = std::numeric_limits<double>::infinity();
+        if (_kdt.range.clip(rp[i], interval.t_min[i], interval.t_max[i]))
+        {
+            mask |= (ray_packet::mask_t)1 << i;
+        }
+    }
+    if (mask)
+    {
+        _intersect_packet(rp, 0, interval, mask, closest_objs, closest_results);
+    }
+}
+
+// multiplies in the objects hit in [t_min, t_max), false if one is opaque
+static inline bool _transmit(const object &obj, const ray &r, double t_min, double t_max,
+                             vector3df &result)
+{
+    if (obj.refractiveness.length2() <= eps2)
+    {
+        return obj.count_intersections(r, t_min, t_max, 1) == 0;
+    }
+
+    std::size_t count = obj.count_intersections(r, t_min, t_max,
+                                                std::numeric_limits<std::size_t>::max());
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        result = result.modulate(obj.refractiveness);
+    }
+    return true;
+}
+
+bool world::transmittance(const ray &r, double t_max, vector3df &result) const
+{
+    result = vector3df::one;
+    if (!_built)
+    {
+        for (auto &o_ptr : _objects)
+        {
+            if (!_transmit(*o_ptr, r, 0.0, t_max, result))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    for (object *o : _unbounded)
+    {
+        if (!_transmit(*o, r, 0.0, t_max, result))
+        {
+            return false;
+        }
+    }
+
+    double t_near = 0.0, t_far = t_max;
+    if (!_kdt.empty() && _kdt.range.clip(r, t_near, t_far))
+    {
+        return _transmittance(r, 0, t_near, t_far, result);
+    }
+    return true;
+}
+
+void world::_intersect(const ray &r, std::size_t node, double t_min, double t_max,
+                       object *&closest_obj, intersect_result &closest_result) const
+{
+    // Every object overlapping this node is also in the nodes covering its
+    // hit point, so a node entered behind the closest hit can be skipped.
+    if (closest_obj && t_min > closest_result.distance)
+    {
+        return;
+    }
+
+    const kd_tree<object_index>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
+    {
+        // near child first
+        std::size_t first, second;
+        double t_split;
+        if (_kdt.clip_children(node, r, t_min, t_max, first, second, t_split) == 2)
+        {
+            _intersect(r, first, t_min, t_split, closest_obj, closest_result);
+            _intersect(r, second, t_split, t_max, closest_obj, closest_result);
+        }
+        else
+        {
+            _intersect(r, first, t_min, t_max, closest_obj, closest_result);
+        }
+        return;
+    }
+
+    for (std::size_t i = n.index; i < n.index + n.size(); ++i)
+    {
+        object &o = *_kdt.points[_kdt.indices[i]].obj;
+        _update_closest(o, o.intersect(r), closest_obj, closest_result);
+    }
+}
+
+void world::_intersect_packet(const ray_packet &rp, std::size_t node,
+                              const ray_packet::interval &interval, ray_packet::mask_t mask,
+                              object **closest_objs, intersect_result *closest_results) const
+{
+    // the cut of _intersect, ray by ray
+    for (ray_packet::mask_t m = mask; m; m &= m - 1)
+    {
+        const std::size_t k = ray_packet::lowest(m);
+        if (closest_objs[k] && interval.t_min[k] > closest_results[k].distance)
+        {
+            mask &= ~((ray_packet::mask_t)1 << k);
+        }
+    }
+    if (!mask)
+    {
+        return;
+    }
+
+    const kd_tree<object_index>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
+    {
+        std::size_t first, second;
+        ray_packet::mask_t first_mask, second_mask;
+        ray_packet::interval first_interval, second_interval;
+        ray_packet::mask_t reversed =
+            _kdt.clip_children(node, rp, mask, interval, first, first_mask, first_interval,
+                               second, second_mask, second_interval);
+        if (first_mask)
+        {
+            _intersect_packet(rp, first, first_interval, first_mask, closest_objs, closest_results);
+        }
+        if (second_mask)
+        {
+            _intersect_packet(rp, second, second_interval, second_mask, closest_objs, closest_results);
+        }
+        if (reversed) // again, front to back for them
+        {
+            _intersect_packet(rp, node, interval, reversed, closest_objs, closest_results);
+        }
+        return;
+    }
+
+    for (std::size_t i = n.index; i < n.index + n.size(); ++i)
+    {
+        object &o = *_kdt.points[_kdt.indices[i]].obj;
+        _update_closest(o, o.intersect_packet(rp, mask, closest_results), closest_objs);
+    }
+}
+
+void world::_intersect_all(const ray &r, std::size_t node, double t_min, double t_max,
+                           std::vector<object *> &result) const
+{
+    const kd_tree<object_index>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
+    {
+        std::size_t first, second;
+        double t_split;
+        if (_kdt.clip_children(node, r, t_min, t_max, first, second, t_split) == 2)
+        {
+            _intersect_all(r, first, t_min, t_split, result);
+            _intersect_all(r, second, t_split, t_max, result);
+        }
+        else
+        {
+            _intersect_all(r, first, t_min, t_max, result);
+        }
+        return;
+    }
+
+    for (std::size_t i = n.index; i < n.index + n.size(); ++i)
+    {
+        result.push_back(_kdt.points[_kdt.indices[i]].obj);
+    }
+}
+
+bool world::_transmittance(const ray &r, std::size_t node, double t_min, double t_max,
+                           vector3df &result) const
+{
+    const kd_tree<object_index>::flat_node &n = _kdt.nodes[node];
+    if (!n.is_leaf())
+    {
+        std::size_t first, second;
+        double t_split;
+        if (_kdt.clip_children(node, r, t_min, t_max, first, second, t_split) == 2)
+        {
+            return _transmittance(r, first, t_min, t_split, result) &&
+                   _transmittance(r, second, t_split, t_max, result);
+        }
+        return _transmittance(r, first, t_min, t_max, result);
+    }
+
+    // Objects may be in more than one leaf, counting only the hits inside
+    // this leaf's interval counts each of them once.
+    for (std::size_t i = n.index; i < n.index + n.size(); ++i)
+    {
+        if (!_transmit(*_kdt.points[_kdt.indices[i]].obj, r, t_min, t_max, result))
+        {
+            return false;
+        }
+    }
+    return true;
 }
\ No newline at end of file
@@ -3,9 +3,12 @@
 
 #include <vector>
 #include <memory>
+#include <cstdint>
 
 #include "object.h"
 #include "light.h"
+#include "aa_cube.h"
+#include "kd_tree.hpp"
 
 class world_intersect_result
 {
@@ -31,13 +34,52 @@ public:
 
 class light;
 
+// bounded object with its bounding box, for kd-tree
+class object_index
+{
+public:
+    object *obj = nullptr;
+
+private:
+    aa_cube aabb = aa_cube(vector3df::zero, vector3df::zero);
+    vector3df centre = vector3df::zero;
+
+public:
+    object_index() = default;
+
+    explicit object_index(object &obj)
+        : obj(&obj), aabb(obj.get_aabb()), centre(aabb.p + aabb.size / 2.0)
+    {
+
+    }
+
+    double get_dim(std::size_t dim)
+    {
+        return centre.dim[dim];
+    }
+
+    const double &get_dim(std::size_t dim) const
+    {
+        return centre.dim[dim];
+    }
+
+    aa_cube get_aabb() const
+    {
+        return aabb;
+    }
+};
+
 class world
 {
 private:
     std::vector<std::shared_ptr<object> > _objects;
+    std::vector<object *> _unbounded; // e.g. planes, tested linearly
+    kd_tree<object_index> _kdt;
+    bool _built = false;
 
 public:
     std::vector<std::shared_ptr<light> > lights;
+    std::uint64_t source_hash = 0; // of the files the scene was loaded from
 
     world()
     {
@@ -47,6 +89,7 @@ public:
     object &add_object(const std::shared_ptr<object> &o_ptr)
     {
         _objects.push_back(o_ptr);
+        _built = false;
         return *o_ptr;
     }
 
@@ -55,14 +98,46 @@ public:
         return *_objects[i];
     }
 
+    std::size_t object_count() const
+    {
+        return _objects.size();
+    }
+
     // Note: references will be invalid.
     void del_object(std::size_t i)
     {
         _objects.erase(_objects.begin() + i);
+        _built = false;
     }
 
+    // Of the objects' bounding boxes and materials, the lights and
+    // source_hash. Tells whether saved hit points still belong to the scene.
+    std::uint64_t fingerprint() const;
+
+    // Builds the kd-tree over object bounding boxes, call it after the scene
+    // is complete. Without it, every ray is tested against every object.
+    void build();
+
     std::vector<world_intersect_result> intersect_all(const ray &r);
     world_intersect_result intersect(const ray &r);
+    // Closest hits of a packet, the same as intersect for each ray.
+    // closest_objs[i] is nullptr if rp[i] hits nothing.
+    void intersect_packet(const ray_packet &rp, object **closest_objs,
+                          intersect_result *closest_results);
+    // Shadow query: product of the refractiveness of everything hit in
+    // [0, t_max), false as soon as an opaque object is hit. Allocates nothing.
+    bool transmittance(const ray &r, double t_max, vector3df &result) const;
+
+private:
+    void _intersect(const ray &r, std::size_t node, double t_min, double t_max,
+                    object *&closest_obj, intersect_result &closest_result) const;
+    void _intersect_packet(const ray_packet &rp, std::size_t node,
+                           const ray_packet::interval &interval, ray_packet::mask_t mask,
+                           object **closest_objs, intersect_result *closest_results) const;
+    void _intersect_all(const ray &r, std::size_t node, double t_min, double t_max,
+                        std::vector<object *> &result) const;
+    bool _transmittance(const ray &r, std::size_t node, double t_min, double t_max,
+                        vector3df &result) const;
 };
 
 #endif // _WORLD_H_
\ No newline at end of file